@@ -0,0 +1,47 @@
+#!/bin/sh
+# File:         busypoll_bench.sh
+# Authors:      Marcin ********
+# Date:         19.10.2026
+# Description:  Script compares tail latency of tcp_echo_serv and
+#               udp_serv in blocking and busy poll mode. Server is
+#               pinned to SERV_CPU, client to CLI_CPU (use different
+#               physical cores, busy poll keeps its core at 100%).
+#
+# Usage:        busypoll_bench.sh [count] [serv_cpu] [cli_cpu]
+
+COUNT=${1:-200000}
+SERV_CPU=${2:-2}
+CLI_CPU=${3:-3}
+TCP_PORT=9110
+UDP_PORT=9111
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$(mktemp -d)
+
+gcc -O2 -pthread -o "$BIN/tcp_echo_serv" "$SRC/TCP/tcp_echo_serv.c" || exit 1
+gcc -O2 -o "$BIN/tcp_echo_cli" "$SRC/TCP/tcp_echo_cli.c" || exit 1
+gcc -O2 -pthread -o "$BIN/udp_serv" "$SRC/UDP/udp_serv.c" || exit 1
+gcc -O2 -o "$BIN/udp_cli" "$SRC/UDP/udp_cli.c" || exit 1
+
+for MODE in blocking busy; do
+  if [ $MODE = busy ]; then
+    OPTS="-P 50 -L -C $SERV_CPU"
+  else
+    OPTS="-C $SERV_CPU"
+  fi
+
+  "$BIN/tcp_echo_serv" -p $TCP_PORT $OPTS > /dev/null &
+  TCP_PID=$!
+  "$BIN/udp_serv" -p $UDP_PORT $OPTS > /dev/null &
+  UDP_PID=$!
+  sleep 0.5
+
+  echo "=== TCP echo, $MODE"
+  taskset -c "$CLI_CPU" "$BIN/tcp_echo_cli" -p $TCP_PORT -n "$COUNT" -s 64
+  echo "=== UDP, $MODE"
+  taskset -c "$CLI_CPU" "$BIN/udp_cli" -p $UDP_PORT -n "$COUNT"
+
+  kill $TCP_PID $UDP_PID
+  wait 2> /dev/null
+done
+
+rm -rf "$BIN"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# File:         coalesce_bench.sh
+# Authors:      Marcin ********
+# Date:         19.10.2026
+# Description:  Script measures write coalescing of the echo client and
+#               server: packets on the wire per message (TCP_INFO
+#               segment counters), send syscalls and throughput for
+#               single requests and pipelined rounds, without and with
+#               coalescing. Every mode runs against its own server
+#               started with the same mode, so a row shows one setting
+#               of both sides.
+#
+#               Pipelined "off" rows stall on Nagle and delayed ACK
+#               (tens of ms per round, see p99): the second small write
+#               of a round waits for the ACK of the first one.
+#
+# Usage:        coalesce_bench.sh [count] [depth]
+
+COUNT=${1:-100000}
+DEPTH=${2:-16}
+BASE_PORT=9120
+MODES="off writev cork more"
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$(mktemp -d)
+
+gcc -O2 -pthread -o "$BIN/tcp_echo_serv" "$SRC/TCP/tcp_echo_serv.c" || exit 1
+gcc -O2 -o "$BIN/tcp_echo_cli" "$SRC/TCP/tcp_echo_cli.c" || exit 1
+
+PORT=$BASE_PORT
+PIDS=
+for MODE in $MODES; do
+  "$BIN/tcp_echo_serv" -p $PORT -c $MODE > /dev/null &
+  PIDS="$PIDS $!"
+  PORT=$((PORT + 1))
+done
+sleep 0.5
+
+for D in 1 "$DEPTH"; do
+  PORT=$BASE_PORT
+  for MODE in $MODES; do
+    echo "=== depth $D, coalescing $MODE (client and server)"
+    "$BIN/tcp_echo_cli" -p $PORT -n "$COUNT" -s 64 -d "$D" -c $MODE
+    PORT=$((PORT + 1))
+  done
+done
+
+kill $PIDS
+rm -rf "$BIN"
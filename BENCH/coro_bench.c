@@ -0,0 +1,397 @@
+/* File:         coro_bench.c
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Program measures scheduling overhead of the coroutine
+ *               handlers (CORO/coro.h) per resume:
+ *
+ *               call      plain indirect call of a function, baseline
+ *               resume    direct resume of a coroutine, no engine
+ *               poll      token passed around a ring of socket pairs,
+ *               epoll     every hop is one resume by the event engine,
+ *                         with a number of idle coroutines registered
+ *                         beside the ring (cost of scanning them)
+ *
+ *               Engine rows include the read() and write() of the
+ *               token; the "syscalls" row measures them without any
+ *               engine, so the difference is the engine itself.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "../CORO/coro.h"
+
+#define MAX_IDLE_COUNTS 16
+
+
+/* Member of the token ring: reads the token and passes it on. */
+struct ring_coro {
+  struct coro co;
+  int next;                     /* write end of the next member */
+  long hops;                    /* hops left to the end of the run */
+};
+
+/* Coroutine of the raw resume loop. */
+struct count_coro {
+  struct coro co;
+  long n;
+};
+
+
+/* Ring members still running; the last one to finish stops the engine. */
+static int ring_left;
+static volatile sig_atomic_t ring_stop;
+
+
+/**************************** FUNCTIONS *******************************/
+
+/**
+ * Function print help for user.
+ */
+void print_info();
+
+
+/**
+ * Function return monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+
+/**
+ * Function measure plain indirect calls and direct coroutine resumes.
+ *
+ * @param n is a number of calls
+ */
+void bench_resume(long n);
+
+
+/**
+ * Function measure one token hop with read() and write() only.
+ *
+ * @param n is a number of hops
+ */
+void bench_syscalls(long n);
+
+
+/**
+ * Function measure engine resumes: token passed n times around a ring
+ * of ring_size coroutines, idle coroutines wait on silent sockets.
+ *
+ * @param kind is CORO_POLL or CORO_EPOLL
+ * @param n is a number of hops
+ * @param ring_size is a number of ring members
+ * @param idle is a number of idle coroutines
+ * @return 0 on success, -1 on error
+ */
+int bench_engine(enum coro_engine_kind kind, long n, int ring_size, int idle);
+
+
+/**
+ * Ring member handler.
+ */
+int ring_coro_fn(struct coro *c);
+
+
+/**
+ * Idle handler, waits for data that never comes.
+ */
+int idle_coro_fn(struct coro *c);
+
+
+/**
+ * Raw resume handler, counts resumes.
+ */
+int count_coro_fn(struct coro *c);
+
+
+/**
+ * Baseline for the raw resume: plain function with the same signature.
+ */
+int plain_fn(struct coro *c);
+
+/**********************************************************************/
+
+
+int main(int argc, char **argv) {
+
+  long n = 100000;
+  int ring_size = 4;
+  int idle[MAX_IDLE_COUNTS] = { 0, 10, 100, 1000 };
+  int n_idle = 4;
+
+  /* Parsing user arguments. */
+  int c, prev_ind;
+
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":n:r:I:h")) != -1 ) {
+	/* Case for "bench -n -r". */
+	if ( optind == prev_ind + 2 && *optarg == '-' ) {
+	  c = ':';
+	  --optind;
+	}
+	/* Other cases. */
+	switch ( c ) {
+	  case 'h':
+		print_info();
+		exit(1);
+	  case 'n':
+		n = atol(optarg);
+		break;
+	  case 'r':
+		ring_size = atoi(optarg);
+		if ( ring_size < 1 ) {
+		  fprintf(stderr, "Wrong ring size: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'I':
+		n_idle = 0;
+		for ( char *tok = strtok(optarg, ","); tok && n_idle < MAX_IDLE_COUNTS; tok = strtok(NULL, ",") ) {
+		  idle[n_idle++] = atoi(tok);
+		}
+		break;
+	  case ':':
+		printf("Option needs a value\n");
+		exit(1);
+	  case '?':
+		fprintf(stderr, "Unknown option: %c.\n", optopt);
+		exit(1);
+	}
+  }
+
+  /* Last hop writes to a member which has already finished. */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Every idle coroutine takes a socket pair. */
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  printf("Coroutine header %zu B, ring member state %zu B\n\n",
+         sizeof(struct coro), sizeof(struct ring_coro));
+  printf("%-10s %8s %12s %12s\n", "mode", "idle", "resumes", "ns/resume");
+
+  bench_resume(n * 10);
+  bench_syscalls(n);
+  for ( int i = 0; i < n_idle; i++ ) {
+    if ( bench_engine(CORO_POLL, n, ring_size, idle[i]) < 0 ||
+         bench_engine(CORO_EPOLL, n, ring_size, idle[i]) < 0 ) {
+      exit(2);
+    }
+  }
+
+  return 0;
+}
+
+
+/*********************** FUNCTIONS DEFINITIONS ************************/
+
+void print_info() {
+	printf("Usage: coro_bench -[OPTION] [VALUE]\n");
+	printf("       coro_bench -[OPTION]... -[OPTION] [VALUE]...\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("       -h            show this help\n");
+	printf("       -n [count]    engine resumes of every run (default 100000)\n");
+	printf("       -r [count]    coroutines passing the token (default 4)\n");
+	printf("       -I [n,...]    idle coroutines of the runs (default 0,10,100,1000)\n");
+	printf("\n");
+	printf("\n");
+}
+
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void bench_resume(long n) {
+  struct count_coro cc = { .co.fn = count_coro_fn };
+
+  /* Volatile pointers keep the calls indirect, like in the engine. */
+  coro_fn volatile plain = plain_fn;
+  coro_fn volatile fn = count_coro_fn;
+
+  uint64_t t0 = now_ns();
+  for ( long i = 0; i < n; i++ ) {
+    plain(&cc.co);
+  }
+  uint64_t t1 = now_ns();
+  for ( long i = 0; i < n; i++ ) {
+    fn(&cc.co);
+  }
+  uint64_t t2 = now_ns();
+
+  printf("%-10s %8s %12ld %12.2f\n", "call", "-", n, (double) (t1 - t0) / n);
+  printf("%-10s %8s %12ld %12.2f\n", "resume", "-", cc.n, (double) (t2 - t1) / n);
+}
+
+
+void bench_syscalls(long n) {
+  int sv[2];
+  char token = 'T';
+
+  if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ) {
+    fprintf(stderr, "ERROR socketpair(): %s\n", strerror(errno));
+    return;
+  }
+
+  uint64_t t0 = now_ns();
+  for ( long i = 0; i < n; i++ ) {
+    if ( write(sv[0], &token, 1) != 1 || read(sv[1], &token, 1) != 1 ) {
+      fprintf(stderr, "ERROR token: %s\n", strerror(errno));
+      break;
+    }
+  }
+  uint64_t t1 = now_ns();
+
+  printf("%-10s %8s %12ld %12.2f\n", "syscalls", "-", n, (double) (t1 - t0) / n);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+
+int bench_engine(enum coro_engine_kind kind, long n, int ring_size, int idle) {
+  struct coro_engine e;
+  int total = ring_size + idle;
+  int (*sv)[2] = calloc(total, sizeof(*sv));
+  int max_fd = 0;
+
+  if ( sv == NULL ) {
+    return -1;
+  }
+  for ( int i = 0; i < total; i++ ) {
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv[i]) < 0 ) {
+      fprintf(stderr, "ERROR socketpair(): %s (raise the descriptor limit)\n", strerror(errno));
+      for ( int j = 0; j < i; j++ ) {
+        close(sv[j][0]);
+        close(sv[j][1]);
+      }
+      free(sv);
+      return -1;
+    }
+    max_fd = sv[i][0] > max_fd ? sv[i][0] : max_fd;
+    max_fd = sv[i][1] > max_fd ? sv[i][1] : max_fd;
+  }
+  if ( coro_engine_init(&e, kind, max_fd + 1) < 0 ) {
+    fprintf(stderr, "ERROR coro_engine_init(): %s\n", strerror(errno));
+    return -1;
+  }
+
+  /* Idle coroutines first, so poll() scans them on every wait. */
+  for ( int i = ring_size; i < total; i++ ) {
+    struct coro *c = calloc(1, sizeof(*c));
+    c->fn = idle_coro_fn;
+    c->fd = sv[i][0];
+    coro_spawn(&e, c);
+  }
+
+  /* Member i reads sv[i][0] and writes to sv[i + 1][1]. Only one token
+   * circulates, so exactly one coroutine is ready at a time. */
+  for ( int i = 0; i < ring_size; i++ ) {
+    struct ring_coro *r = calloc(1, sizeof(*r));
+    r->co.fn = ring_coro_fn;
+    r->co.fd = sv[i][0];
+    r->next = sv[(i + 1) % ring_size][1];
+    r->hops = n / ring_size;
+    coro_spawn(&e, &r->co);
+  }
+
+  ring_left = ring_size;
+  ring_stop = 0;
+  uint64_t resumes = e.resumes;
+  uint64_t t0 = now_ns();
+  if ( write(sv[0][1], "T", 1) != 1 ) {
+    fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+  }
+  /* Idle coroutines never finish, the run ends with the last hop. */
+  coro_engine_run(&e, &ring_stop);
+  uint64_t t1 = now_ns();
+  resumes = e.resumes - resumes;
+
+  printf("%-10s %8d %12llu %12.2f\n", kind == CORO_POLL ? "poll" : "epoll", idle,
+         (unsigned long long) resumes, (double) (t1 - t0) / resumes);
+
+  /* Engine closed the read ends of the ring, the rest is ours. */
+  for ( int i = 0; i < total; i++ ) {
+    if ( i >= ring_size ) {
+      struct coro *c = e.by_fd[sv[i][0]];
+      coro_remove(&e, c);
+      free(c);
+      close(sv[i][0]);
+    }
+    close(sv[i][1]);
+  }
+  if ( kind == CORO_EPOLL ) {
+    close(e.epfd);
+  }
+  free(e.by_fd);
+  free(e.pfd);
+  free(e.slot);
+  free(e.events);
+  free(sv);
+
+  return 0;
+}
+
+
+int ring_coro_fn(struct coro *c) {
+  struct ring_coro *r = (struct ring_coro *) c;
+  char token;
+
+  CORO_BEGIN(c);
+  while ( r->hops > 0 ) {
+    CORO_AWAIT(c, CORO_READ, read(c->fd, &token, 1));
+    if ( c->ret != 1 ) {
+      break;
+    }
+    r->hops--;
+    /* One byte always fits into an empty socket buffer. */
+    if ( write(r->next, "T", 1) != 1 ) {
+      break;
+    }
+  }
+  if ( --ring_left == 0 ) {
+    ring_stop = 1;
+  }
+  CORO_END(c);
+}
+
+
+int idle_coro_fn(struct coro *c) {
+  (void) c;
+  return CORO_READ;
+}
+
+
+int count_coro_fn(struct coro *c) {
+  struct count_coro *cc = (struct count_coro *) c;
+
+  CORO_BEGIN(c);
+  while ( 1 ) {
+    cc->n++;
+    CORO_YIELD(c, CORO_READ);
+  }
+  CORO_END(c);
+}
+
+
+int plain_fn(struct coro *c) {
+  (void) c;
+  return CORO_READ;
+}
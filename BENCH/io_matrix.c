@@ -0,0 +1,853 @@
+/* File:         io_matrix.c
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Program measures the syscall strategies of an echo
+ *               handler over loopback TCP for message sizes from 16 B
+ *               to 1 MiB. The handler logic is the same for all of
+ *               them: receive into a buffer of one message, send back
+ *               what was received. Strategies:
+ *
+ *               rw        read() / write()
+ *               vec       readv() / writev()
+ *               msg       recvmsg() / sendmsg()
+ *               mmsg      recvmmsg() / sendmmsg(), up to depth buffers
+ *                         per call
+ *               uring     io_uring (raw syscalls), send of a message
+ *                         and receive of the next one share one
+ *                         io_uring_enter()
+ *               splice    socket -> pipe -> socket, no user copy
+ *
+ *               The client (the same for all runs) sends rounds of
+ *               depth pipelined messages with plain write()/read().
+ *               For every run the handler side reports syscalls and
+ *               CPU cycles (perf_event_open(), when the kernel allows
+ *               it) per message, the client reports ns per message.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+
+#define MAX_SIZES 16
+#define MAX_BATCH 64                      /* recvmmsg()/sendmmsg() vector */
+#define MAX_INFLIGHT (256 * 1024)         /* bytes of one pipelined round */
+#define URING_ENTRIES 8
+#define URING_RECV 1                      /* user_data of completions */
+#define URING_SEND 2
+
+enum strategy {
+  IO_RW,
+  IO_VEC,
+  IO_MSG,
+  IO_MMSG,
+  IO_URING,
+  IO_SPLICE,
+  IO_STRATEGIES
+};
+
+static const char *strategy_names[IO_STRATEGIES] = { "rw", "vec", "msg", "mmsg", "uring", "splice" };
+
+/* What perf_event_open() could count. */
+enum cycles_kind {
+  CYCLES_NONE,
+  CYCLES_ALL,                             /* user and kernel */
+  CYCLES_USER                             /* perf_event_paranoid > 1 */
+};
+
+/* One run: handler configuration and its counters. */
+struct run {
+  int listen_fd;
+  enum strategy s;
+  size_t size;
+  int depth;
+  uint64_t syscalls;
+  uint64_t cycles;
+  enum cycles_kind cycles_kind;
+  uint64_t bytes;                         /* bytes echoed */
+  int error;                              /* errno of a failed handler */
+};
+
+/* io_uring rings mapped from the kernel. */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+
+
+/**************************** FUNCTIONS *******************************/
+
+/**
+ * Function print help for user.
+ */
+void print_info();
+
+
+/**
+ * Function return monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+
+/**
+ * Function run one strategy and size: start handler thread, send
+ * count messages and print the row.
+ *
+ * @param r is a run with listen_fd, s, size and depth set
+ * @param count is a number of messages
+ * @param ns_per_msg is a client time per message of the run
+ * @return 0 on success, -1 on error
+ */
+int run_one(struct run *r, long count, double *ns_per_msg);
+
+
+/**
+ * Handler thread: accept one connection and echo it with the strategy
+ * of the run until the client closes.
+ *
+ * @param arg is a struct run
+ */
+void *handler_func(void *arg);
+
+
+/**
+ * Function open CPU cycle counter of the calling thread.
+ *
+ * @return counter descriptor or -1 if cycles cannot be counted
+ */
+int cycles_open(enum cycles_kind *kind);
+
+
+/**
+ * Echo handlers of the strategies.
+ *
+ * @param fd is a connected socket
+ * @param r is a run, counters are updated
+ * @return 0 when the client closed, -1 on error
+ */
+int echo_rw(int fd, struct run *r);
+int echo_vec(int fd, struct run *r);
+int echo_msg(int fd, struct run *r);
+int echo_mmsg(int fd, struct run *r);
+int echo_uring(int fd, struct run *r);
+int echo_splice(int fd, struct run *r);
+
+
+/**
+ * Function set up io_uring with raw syscalls.
+ *
+ * @return 0 on success, -1 on error
+ */
+int uring_init(struct uring *u, unsigned entries);
+
+
+/**
+ * Function unmap rings and close io_uring.
+ */
+void uring_free(struct uring *u);
+
+
+/**
+ * Function queue one receive or send.
+ */
+void uring_prep(struct uring *u, int op, int fd, void *buf, size_t len, uint64_t user_data);
+
+
+/**
+ * Function write whole buffer.
+ *
+ * @return 0 on success, -1 on error
+ */
+int write_all(int fd, const char *buf, size_t len);
+
+
+/**
+ * Function read exactly len bytes.
+ *
+ * @return 0 on success, -1 on error or end of stream
+ */
+int read_all(int fd, char *buf, size_t len);
+
+/**********************************************************************/
+
+
+int main(int argc, char **argv) {
+
+  size_t sizes[MAX_SIZES] = { 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+  int n_sizes = 9;
+  bool enabled[IO_STRATEGIES] = { true, true, true, true, true, true };
+  long max_count = 100000;
+  long max_mb = 256;
+  int depth = 1;
+
+  /* Parsing user arguments. */
+  int c, prev_ind;
+
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":n:m:d:s:S:h")) != -1 ) {
+	/* Case for "bench -n -s". */
+	if ( optind == prev_ind + 2 && *optarg == '-' ) {
+	  c = ':';
+	  --optind;
+	}
+	/* Other cases. */
+	switch ( c ) {
+	  case 'h':
+		print_info();
+		exit(1);
+	  case 'n':
+		max_count = atol(optarg);
+		break;
+	  case 'm':
+		max_mb = atol(optarg);
+		break;
+	  case 'd':
+		depth = atoi(optarg);
+		if ( depth < 1 || depth > MAX_BATCH ) {
+		  fprintf(stderr, "Wrong depth (1 - %d): %s.\n", MAX_BATCH, optarg);
+		  exit(1);
+		}
+		break;
+	  case 's':
+		n_sizes = 0;
+		for ( char *tok = strtok(optarg, ","); tok && n_sizes < MAX_SIZES; tok = strtok(NULL, ",") ) {
+		  sizes[n_sizes] = atol(tok);
+		  if ( sizes[n_sizes] == 0 || sizes[n_sizes] > (1 << 20) ) {
+		    fprintf(stderr, "Wrong size (1 B - 1 MiB): %s.\n", tok);
+		    exit(1);
+		  }
+		  n_sizes++;
+		}
+		break;
+	  case 'S':
+		memset(enabled, 0, sizeof(enabled));
+		for ( char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",") ) {
+		  int i = 0;
+		  while ( i < IO_STRATEGIES && strcmp(tok, strategy_names[i]) != 0 ) {
+		    i++;
+		  }
+		  if ( i == IO_STRATEGIES ) {
+		    fprintf(stderr, "Unknown strategy: %s.\n", tok);
+		    exit(1);
+		  }
+		  enabled[i] = true;
+		}
+		break;
+	  case ':':
+		printf("Option needs a value\n");
+		exit(1);
+	  case '?':
+		fprintf(stderr, "Unknown option: %c.\n", optopt);
+		exit(1);
+	}
+  }
+
+  /* Peer of a failed handler may be gone. */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Handler listens on an ephemeral loopback port. */
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  socklen_t len = sizeof(addr);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+  const int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( listen_fd < 0 ) {
+    fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+    exit(2);
+  }
+  if ( bind(listen_fd, (struct sockaddr*) &addr, len) < 0 || listen(listen_fd, 1) < 0 ||
+       getsockname(listen_fd, (struct sockaddr*) &addr, &len) < 0 ) {
+    fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+    exit(3);
+  }
+
+  printf("%8s %-7s %8s %12s %12s %12s %10s\n", "size", "io", "messages", "ns/msg",
+         "syscalls/msg", "cycles/msg", "MB/s");
+
+  for ( int i = 0; i < n_sizes; i++ ) {
+    /* Enough messages for a stable rate, bounded by bytes. */
+    long count = (max_mb << 20) / sizes[i];
+    count = count > max_count ? max_count : count;
+    count = count < 100 ? 100 : count;
+
+    int best = -1;
+    double best_ns = 0;
+
+    for ( int s = 0; s < IO_STRATEGIES; s++ ) {
+      if ( !enabled[s] ) {
+        continue;
+      }
+      struct run r = { .listen_fd = listen_fd, .s = s, .size = sizes[i], .depth = depth };
+      double ns;
+      if ( run_one(&r, count, &ns) == 0 && (best < 0 || ns < best_ns) ) {
+        best = s;
+        best_ns = ns;
+      }
+    }
+    if ( best >= 0 ) {
+      printf("%8zu %-7s fastest\n\n", sizes[i], strategy_names[best]);
+    }
+  }
+
+  close(listen_fd);
+  return 0;
+}
+
+
+/*********************** FUNCTIONS DEFINITIONS ************************/
+
+void print_info() {
+	printf("Usage: io_matrix -[OPTION] [VALUE]\n");
+	printf("       io_matrix -[OPTION]... -[OPTION] [VALUE]...\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("       -h            show this help\n");
+	printf("       -s [B,...]    message sizes (default 16,64,...,1048576)\n");
+	printf("       -S [io,...]   strategies: rw, vec, msg, mmsg, uring, splice (default all)\n");
+	printf("       -d [depth]    messages in flight (default 1, at most %d)\n", MAX_BATCH);
+	printf("       -n [count]    messages of a run (default 100000)\n");
+	printf("       -m [MiB]      bytes of a run at most (default 256)\n");
+	printf("\n");
+	printf("Cycles are counted for the handler thread only; \"(u)\" marks\n");
+	printf("user space cycles when kernel.perf_event_paranoid hides the kernel.\n");
+	printf("\n");
+}
+
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+int run_one(struct run *r, long count, double *ns_per_msg) {
+  pthread_t thread;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int one = 1;
+
+  /* Large messages in flight are limited, so neither side blocks on
+   * a full socket while the other one does too. */
+  int depth = r->depth;
+  while ( depth > 1 && depth * r->size > MAX_INFLIGHT ) {
+    depth--;
+  }
+  size_t round = depth * r->size;
+  long rounds = (count + depth - 1) / depth;
+
+  char *buf = malloc(round);
+  if ( buf == NULL ) {
+    return -1;
+  }
+  memset(buf, 'x', round);
+
+  getsockname(r->listen_fd, (struct sockaddr*) &addr, &len);
+  if ( pthread_create(&thread, NULL, handler_func, r) != 0 ) {
+    fprintf(stderr, "ERROR pthread_create()\n");
+    free(buf);
+    return -1;
+  }
+
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( fd < 0 || connect(fd, (struct sockaddr*) &addr, len) < 0 ) {
+    fprintf(stderr, "ERROR connect(): %s\n", strerror(errno));
+    exit(4);
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  uint64_t t0 = now_ns();
+  long done = 0;
+  for ( ; done < rounds; done++ ) {
+    if ( write_all(fd, buf, round) < 0 || read_all(fd, buf, round) < 0 ) {
+      break;
+    }
+  }
+  uint64_t t1 = now_ns();
+
+  /* Handler ends on end of stream. */
+  shutdown(fd, SHUT_WR);
+  while ( read(fd, buf, round) > 0 ) {
+  }
+  close(fd);
+  pthread_join(thread, NULL);
+  free(buf);
+
+  if ( done < rounds || r->error ) {
+    printf("%8zu %-7s %8s %s\n", r->size, strategy_names[r->s], "-",
+           r->error ? strerror(r->error) : "connection failed");
+    return -1;
+  }
+
+  long msgs = rounds * depth;
+  double ns = (double) (t1 - t0) / msgs;
+  char cycles[32] = "-";
+  if ( r->cycles_kind != CYCLES_NONE ) {
+    snprintf(cycles, sizeof(cycles), "%.0f%s", (double) r->cycles / msgs,
+             r->cycles_kind == CYCLES_USER ? " (u)" : "");
+  }
+  printf("%8zu %-7s %8ld %12.0f %12.2f %12s %10.1f\n", r->size, strategy_names[r->s], msgs, ns,
+         (double) r->syscalls / msgs, cycles, (double) r->size * msgs / ((t1 - t0) / 1e3));
+  fflush(stdout);
+
+  *ns_per_msg = ns;
+  return 0;
+}
+
+
+void *handler_func(void *arg) {
+  struct run *r = arg;
+  static int (*const echo[IO_STRATEGIES])(int, struct run *) = {
+    echo_rw, echo_vec, echo_msg, echo_mmsg, echo_uring, echo_splice
+  };
+  int one = 1;
+
+  const int fd = accept4(r->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if ( fd < 0 ) {
+    r->error = errno;
+    return NULL;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  /* Only the echo loop is counted. */
+  int perf_fd = cycles_open(&r->cycles_kind);
+  if ( perf_fd >= 0 ) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  if ( echo[r->s](fd, r) < 0 ) {
+    r->error = errno ? errno : EIO;
+  }
+
+  if ( perf_fd >= 0 ) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if ( read(perf_fd, &r->cycles, sizeof(r->cycles)) != sizeof(r->cycles) ) {
+      r->cycles_kind = CYCLES_NONE;
+    }
+    close(perf_fd);
+  }
+  close(fd);
+
+  return NULL;
+}
+
+
+int cycles_open(enum cycles_kind *kind) {
+  struct perf_event_attr attr = {
+    .type = PERF_TYPE_HARDWARE,
+    .size = sizeof(attr),
+    .config = PERF_COUNT_HW_CPU_CYCLES,
+    .disabled = 1,
+    .exclude_hv = 1
+  };
+
+  /* Calling thread on any CPU. */
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if ( fd >= 0 ) {
+    *kind = CYCLES_ALL;
+    return fd;
+  }
+  attr.exclude_kernel = 1;
+  fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  *kind = fd >= 0 ? CYCLES_USER : CYCLES_NONE;
+
+  return fd;
+}
+
+
+int echo_rw(int fd, struct run *r) {
+  char *buf = malloc(r->size);
+  ssize_t n;
+
+  if ( buf == NULL ) {
+    return -1;
+  }
+  while ( r->syscalls++, (n = read(fd, buf, r->size)) > 0 ) {
+    ssize_t off = 0, w = 0;
+    while ( off < n && (r->syscalls++, (w = write(fd, buf + off, n - off))) > 0 ) {
+      off += w;
+    }
+    if ( w < 0 ) {
+      break;
+    }
+    r->bytes += n;
+  }
+  free(buf);
+
+  return n == 0 ? 0 : -1;
+}
+
+
+int echo_vec(int fd, struct run *r) {
+  char *buf = malloc(r->size);
+  struct iovec iov = { .iov_base = buf, .iov_len = r->size };
+  ssize_t n;
+
+  if ( buf == NULL ) {
+    return -1;
+  }
+  while ( r->syscalls++, (n = readv(fd, &iov, 1)) > 0 ) {
+    struct iovec out = { .iov_base = buf, .iov_len = n };
+    ssize_t w = 0;
+    while ( out.iov_len > 0 && (r->syscalls++, (w = writev(fd, &out, 1))) > 0 ) {
+      out.iov_base = (char *) out.iov_base + w;
+      out.iov_len -= w;
+    }
+    if ( w < 0 ) {
+      break;
+    }
+    r->bytes += n;
+  }
+  free(buf);
+
+  return n == 0 ? 0 : -1;
+}
+
+
+int echo_msg(int fd, struct run *r) {
+  char *buf = malloc(r->size);
+  struct iovec iov = { .iov_base = buf, .iov_len = r->size };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  ssize_t n;
+
+  if ( buf == NULL ) {
+    return -1;
+  }
+  while ( r->syscalls++, (n = recvmsg(fd, &msg, 0)) > 0 ) {
+    struct iovec out = { .iov_base = buf, .iov_len = n };
+    struct msghdr omsg = { .msg_iov = &out, .msg_iovlen = 1 };
+    ssize_t w = 0;
+    while ( out.iov_len > 0 && (r->syscalls++, (w = sendmsg(fd, &omsg, 0))) > 0 ) {
+      out.iov_base = (char *) out.iov_base + w;
+      out.iov_len -= w;
+    }
+    if ( w < 0 ) {
+      break;
+    }
+    r->bytes += n;
+  }
+  free(buf);
+
+  return n == 0 ? 0 : -1;
+}
+
+
+int echo_mmsg(int fd, struct run *r) {
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iov[MAX_BATCH];
+  int batch = r->depth;
+  char *buf = malloc(r->size * batch);
+  int n;
+
+  if ( buf == NULL ) {
+    return -1;
+  }
+
+  /* A stream does not keep message boundaries: every buffer takes up
+   * to one message of bytes, all of them are sent back in order. */
+  while ( 1 ) {
+    for ( int i = 0; i < batch; i++ ) {
+      iov[i] = (struct iovec) { .iov_base = buf + i * r->size, .iov_len = r->size };
+      msgs[i] = (struct mmsghdr) { .msg_hdr = { .msg_iov = &iov[i], .msg_iovlen = 1 } };
+    }
+    r->syscalls++;
+    n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, NULL);
+    if ( n <= 0 || msgs[0].msg_len == 0 ) {
+      n = n < 0 ? -1 : 0;
+      break;
+    }
+
+    /* End of stream after some data is seen by the next call. */
+    int filled = 0;
+    while ( filled < n && msgs[filled].msg_len > 0 ) {
+      iov[filled].iov_len = msgs[filled].msg_len;
+      r->bytes += msgs[filled].msg_len;
+      filled++;
+    }
+
+    int sent = 0;
+    while ( sent < filled ) {
+      r->syscalls++;
+      int k = sendmmsg(fd, msgs + sent, filled - sent, 0);
+      if ( k <= 0 ) {
+        break;
+      }
+      /* Short send of the last message is retried as its rest. */
+      for ( int i = sent; i < sent + k; i++ ) {
+        if ( msgs[i].msg_len < iov[i].iov_len ) {
+          iov[i].iov_base = (char *) iov[i].iov_base + msgs[i].msg_len;
+          iov[i].iov_len -= msgs[i].msg_len;
+          k = i - sent;
+          break;
+        }
+      }
+      sent += k;
+    }
+    if ( sent < filled ) {
+      n = -1;
+      break;
+    }
+  }
+  free(buf);
+
+  return n;
+}
+
+
+int echo_uring(int fd, struct run *r) {
+  struct uring u;
+  char *buf[2];
+  int cur = 0;
+  bool recv_busy = false, send_busy = false, eof = false;
+  size_t pending = 0;                     /* received in buf[cur], not sent */
+  char *send_ptr = NULL;
+  size_t send_left = 0;
+  int ret = 0;
+
+  if ( uring_init(&u, URING_ENTRIES) < 0 ) {
+    return -1;
+  }
+  buf[0] = malloc(r->size);
+  buf[1] = malloc(r->size);
+  if ( buf[0] == NULL || buf[1] == NULL ) {
+    uring_free(&u);
+    free(buf[0]);
+    free(buf[1]);
+    return -1;
+  }
+
+  /* Two buffers: while one is sent, the next message is received into
+   * the other, so both share one io_uring_enter(). */
+  while ( 1 ) {
+    if ( !send_busy && pending > 0 ) {
+      send_ptr = buf[cur];
+      send_left = pending;
+      uring_prep(&u, IORING_OP_SEND, fd, send_ptr, send_left, URING_SEND);
+      send_busy = true;
+      r->bytes += pending;
+      pending = 0;
+      cur ^= 1;
+    }
+    if ( !recv_busy && !eof && pending == 0 ) {
+      uring_prep(&u, IORING_OP_RECV, fd, buf[cur], r->size, URING_RECV);
+      recv_busy = true;
+    }
+    if ( !recv_busy && !send_busy ) {
+      break;
+    }
+
+    r->syscalls++;
+    if ( syscall(__NR_io_uring_enter, u.fd, u.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      ret = -1;
+      break;
+    }
+    u.to_submit = 0;
+
+    unsigned head = *u.cq_head;
+    unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++ ) {
+      struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+      if ( cqe->user_data == URING_RECV ) {
+        recv_busy = false;
+        if ( cqe->res <= 0 ) {
+          eof = true;
+          ret = cqe->res < 0 ? (errno = -cqe->res, -1) : 0;
+        } else {
+          pending = cqe->res;
+        }
+      } else if ( cqe->res <= 0 ) {
+        send_busy = false;
+        eof = true;
+        errno = -cqe->res;
+        ret = -1;
+      } else if ( (size_t) cqe->res < send_left ) {
+        send_ptr += cqe->res;
+        send_left -= cqe->res;
+        uring_prep(&u, IORING_OP_SEND, fd, send_ptr, send_left, URING_SEND);
+      } else {
+        send_busy = false;
+      }
+    }
+    __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  uring_free(&u);
+  free(buf[0]);
+  free(buf[1]);
+
+  return ret;
+}
+
+
+int echo_splice(int fd, struct run *r) {
+  int p[2];
+  ssize_t n;
+
+  if ( pipe2(p, O_CLOEXEC) < 0 ) {
+    return -1;
+  }
+  /* Pipe holds one message, at least the default 64 KiB. */
+  if ( r->size > 65536 ) {
+    fcntl(p[1], F_SETPIPE_SZ, (int) r->size);
+  }
+
+  while ( r->syscalls++, (n = splice(fd, NULL, p[1], NULL, r->size, SPLICE_F_MOVE)) > 0 ) {
+    ssize_t left = n;
+    while ( left > 0 ) {
+      r->syscalls++;
+      ssize_t w = splice(p[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+      if ( w <= 0 ) {
+        n = -1;
+        break;
+      }
+      left -= w;
+    }
+    if ( n < 0 ) {
+      break;
+    }
+    r->bytes += n;
+  }
+  close(p[0]);
+  close(p[1]);
+
+  return n == 0 ? 0 : -1;
+}
+
+
+int uring_init(struct uring *u, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if ( u->fd < 0 ) {
+    return -1;
+  }
+
+  u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+  }
+
+  u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if ( u->sq_ptr == MAP_FAILED ) {
+    close(u->fd);
+    return -1;
+  }
+  u->cq_ptr = u->sq_ptr;
+  if ( !(p.features & IORING_FEAT_SINGLE_MMAP) ) {
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if ( u->cq_ptr == MAP_FAILED ) {
+      munmap(u->sq_ptr, u->sq_size);
+      close(u->fd);
+      return -1;
+    }
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if ( u->sqes == MAP_FAILED ) {
+    u->sqes = NULL;
+    uring_free(u);
+    return -1;
+  }
+
+  char *sq = u->sq_ptr, *cq = u->cq_ptr;
+  u->sq_head = (unsigned *) (sq + p.sq_off.head);
+  u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *) (sq + p.sq_off.array);
+  u->cq_head = (unsigned *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+
+void uring_free(struct uring *u) {
+  if ( u->sqes != NULL ) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if ( u->cq_ptr != u->sq_ptr ) {
+    munmap(u->cq_ptr, u->cq_size);
+  }
+  munmap(u->sq_ptr, u->sq_size);
+  close(u->fd);
+}
+
+
+void uring_prep(struct uring *u, int op, int fd, void *buf, size_t len, uint64_t user_data) {
+  unsigned tail = *u->sq_tail;
+  unsigned idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+
+  /* Kernel sees the entry only after the tail moves. */
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+}
+
+
+int write_all(int fd, const char *buf, size_t len) {
+  while ( len > 0 ) {
+    ssize_t n = write(fd, buf, len);
+    if ( n <= 0 ) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+int read_all(int fd, char *buf, size_t len) {
+  while ( len > 0 ) {
+    ssize_t n = read(fd, buf, len);
+    if ( n <= 0 ) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# File:         kv_bench.sh
+# Authors:      Marcin ********
+# Date:         19.10.2026
+# Description:  Script measures ops/s of the tcp_serv key-value cache
+#               for several pipeline depths and request mixes.
+#
+# Usage:        kv_bench.sh [workers] [client_threads] [count]
+
+WORKERS=${1:-2}
+THREADS=${2:-2}
+COUNT=${3:-2000000}
+PORT=9120
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$(mktemp -d)
+
+gcc -O2 -pthread -o "$BIN/tcp_serv" "$SRC/TCP/tcp_serv.c" || exit 1
+gcc -O2 -pthread -o "$BIN/tcp_cli" "$SRC/TCP/tcp_cli.c" || exit 1
+
+"$BIN/tcp_serv" -k -w "$WORKERS" -m 256 -p $PORT > /dev/null &
+SERV_PID=$!
+sleep 0.5
+
+for DEPTH in 1 8 32 128; do
+  for SETS in 0 10 50; do
+    echo "=== depth $DEPTH, $SETS% SET"
+    "$BIN/tcp_cli" -k -p $PORT -w "$WORKERS" -T "$THREADS" -n "$COUNT" -d $DEPTH -r $SETS
+  done
+done
+
+kill $SERV_PID
+rm -rf "$BIN"
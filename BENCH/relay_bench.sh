@@ -0,0 +1,34 @@
+#!/bin/sh
+# File:         relay_bench.sh
+# Authors:      Marcin ********
+# Date:         19.10.2026
+# Description:  Script measures overhead of the tcp_echo_serv relay mode:
+#               the same echo benchmark is run directly against the echo
+#               server and through the relay.
+#
+# Usage:        relay_bench.sh [count]
+
+COUNT=${1:-100000}
+ECHO_PORT=9100
+RELAY_PORT=9101
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$(mktemp -d)
+
+gcc -O2 -pthread -o "$BIN/tcp_echo_serv" "$SRC/TCP/tcp_echo_serv.c" || exit 1
+gcc -O2 -o "$BIN/tcp_echo_cli" "$SRC/TCP/tcp_echo_cli.c" || exit 1
+
+"$BIN/tcp_echo_serv" -p $ECHO_PORT > /dev/null &
+ECHO_PID=$!
+"$BIN/tcp_echo_serv" -p $RELAY_PORT -u 127.0.0.1:$ECHO_PORT > /dev/null &
+RELAY_PID=$!
+sleep 0.5
+
+for SIZE in 64 1024 4096; do
+  echo "=== direct, $SIZE B"
+  "$BIN/tcp_echo_cli" -p $ECHO_PORT -n "$COUNT" -s $SIZE
+  echo "=== relay, $SIZE B"
+  "$BIN/tcp_echo_cli" -p $RELAY_PORT -n "$COUNT" -s $SIZE
+done
+
+kill $RELAY_PID $ECHO_PID
+rm -rf "$BIN"
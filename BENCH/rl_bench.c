@@ -0,0 +1,203 @@
+/* File:         rl_bench.c
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Program measures lookup cost of the per source rate
+ *               limiter of udp_serv (UDP/ratelimit.h) over source
+ *               address spreads seen by a real server:
+ *
+ *               one       a single client
+ *               /24       all hosts of one subnet
+ *               64x/24    hosts of 64 subnets, fills the table
+ *               /16       one large network, more sources than entries
+ *               /8        random sources (spoofed flood), every lookup
+ *                         misses and evicts
+ *
+ *               Columns: "table" is rl_allow_at() with the time passed
+ *               in (hash, bucket scan, token refill), "server" is
+ *               rl_allow() as udp_serv calls it, with clock_gettime().
+ *               Lookup order is precomputed and random within the spread.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../UDP/ratelimit.h"
+
+#define SEQ_LEN (1 << 20)       /* precomputed lookups, repeated */
+
+
+/* Source address spread: count hosts starting at base, hosts of one
+ * subnet are consecutive, subnets are stride apart. */
+struct spread {
+  const char *name;
+  uint32_t base;                /* host order */
+  uint32_t hosts;               /* hosts per subnet */
+  uint32_t subnets;
+  uint32_t stride;
+};
+
+
+/**************************** FUNCTIONS *******************************/
+
+/**
+ * Function print help for user.
+ */
+void print_info();
+
+
+/**
+ * Function return monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+
+/**
+ * Function measure one spread and print its row.
+ *
+ * @param sp is a source address spread
+ * @param n is a number of lookups
+ * @param rate is a per source rate of the limiter
+ * @param seq is a buffer of SEQ_LEN addresses
+ */
+void bench_spread(const struct spread *sp, long n, uint32_t rate, uint32_t *seq);
+
+/**********************************************************************/
+
+
+int main(int argc, char **argv) {
+
+  long n = 10000000;
+  uint32_t rate = 1000;
+
+  /* Parsing user arguments. */
+  int c, prev_ind;
+
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":n:r:h")) != -1 ) {
+	/* Case for "bench -n -r". */
+	if ( optind == prev_ind + 2 && *optarg == '-' ) {
+	  c = ':';
+	  --optind;
+	}
+	/* Other cases. */
+	switch ( c ) {
+	  case 'h':
+		print_info();
+		exit(1);
+	  case 'n':
+		n = atol(optarg);
+		break;
+	  case 'r':
+		rate = atol(optarg);
+		if ( rate == 0 || rate > RL_MAX_BURST ) {
+		  fprintf(stderr, "Wrong rate: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case ':':
+		printf("Option needs a value\n");
+		exit(1);
+	  case '?':
+		fprintf(stderr, "Unknown option: %c.\n", optopt);
+		exit(1);
+	}
+  }
+
+  const struct spread spreads[] = {
+    { "one",    0xC0A80105, 1,     1,   0 },
+    { "/24",    0xC0A80101, 254,   1,   0 },
+    { "64x/24", 0x0A000001, 254,   64,  0x10000 },
+    { "/16",    0xAC100001, 65534, 1,   0 },
+    { "/8",     0x0A000001, 1,     1 << 20, 16 }
+  };
+
+  uint32_t *seq = malloc(SEQ_LEN * sizeof(uint32_t));
+  if ( seq == NULL ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  printf("Table %d entries (%d buckets x %d ways, %zu KiB), rate %u pps per source\n\n",
+         RL_BUCKETS * RL_WAYS, RL_BUCKETS, RL_WAYS, RL_BUCKETS * sizeof(struct rl_bucket) >> 10, rate);
+  printf("%-8s %9s %12s %12s %10s\n", "spread", "sources", "table ns", "server ns", "evicted");
+  for ( size_t i = 0; i < sizeof(spreads) / sizeof(spreads[0]); i++ ) {
+    bench_spread(&spreads[i], n, rate, seq);
+  }
+  free(seq);
+
+  return 0;
+}
+
+
+/*********************** FUNCTIONS DEFINITIONS ************************/
+
+void print_info() {
+	printf("Usage: rl_bench -[OPTION] [VALUE]\n");
+	printf("       rl_bench -[OPTION]... -[OPTION] [VALUE]...\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("       -h            show this help\n");
+	printf("       -n [count]    lookups of every spread (default 10000000)\n");
+	printf("       -r [pps]      per source rate of the limiter (default 1000)\n");
+	printf("\n");
+	printf("\n");
+}
+
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void bench_spread(const struct spread *sp, long n, uint32_t rate, uint32_t *seq) {
+  struct rate_limit rl = { .rate = rate, .burst = rate };
+  uint64_t rnd = 0x9E3779B97F4A7C15ULL;
+  uint64_t sources = (uint64_t) sp->hosts * sp->subnets;
+
+  rl.table = aligned_alloc(64, RL_BUCKETS * sizeof(struct rl_bucket));
+  if ( rl.table == NULL ) {
+    fprintf(stderr, "ERROR aligned_alloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  for ( long i = 0; i < SEQ_LEN; i++ ) {
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    uint64_t k = rnd % sources;
+    seq[i] = htonl(sp->base + (uint32_t) (k / sp->hosts) * sp->stride + (uint32_t) (k % sp->hosts));
+  }
+
+  /* Table only: time advances 1 us per 1000 lookups (1M pps). */
+  memset(rl.table, 0, RL_BUCKETS * sizeof(struct rl_bucket));
+  uint64_t now_us = now_ns() / 1000;
+  uint64_t t0 = now_ns();
+  for ( long i = 0; i < n; i++ ) {
+    rl_allow_at(&rl, seq[i & (SEQ_LEN - 1)], now_us + i / 1000);
+  }
+  uint64_t t1 = now_ns();
+  double evicted = 100.0 * rl.evicted / n;
+
+  /* As the server calls it. */
+  memset(rl.table, 0, RL_BUCKETS * sizeof(struct rl_bucket));
+  uint64_t t2 = now_ns();
+  for ( long i = 0; i < n; i++ ) {
+    rl_allow(&rl, seq[i & (SEQ_LEN - 1)]);
+  }
+  uint64_t t3 = now_ns();
+
+  printf("%-8s %9llu %12.2f %12.2f %9.1f%%\n", sp->name, (unsigned long long) sources,
+         (double) (t1 - t0) / n, (double) (t3 - t2) / n, evicted);
+  free(rl.table);
+}
@@ -0,0 +1,743 @@
+/* File:         soak.c
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Program runs steady mixed TCP/UDP load with connection
+ *               churn against tcp_echo_serv and udp_serv for a long
+ *               time. Every interval it samples RSS, open descriptors
+ *               and socket queues of the server processes from /proc
+ *               and latency percentiles of the load, at the end it
+ *               fits a regression line to every series and reports
+ *               those that keep growing (leaks, drift).
+ *
+ *               Load is open loop: every thread keeps its schedule of
+ *               cfg.rate requests/s and latency is measured from the
+ *               scheduled send time, so a stalled server shows up in
+ *               the percentiles instead of just slowing the load down
+ *               (coordinated omission).
+ *
+ *               The bench modes of tcp_echo_cli and udp_cli (-n) are
+ *               closed loop and report one run; a soak needs paced
+ *               open loop load, TCP connection churn and a histogram
+ *               per interval, so it generates its own.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define SERV_IP "127.0.0.1"
+#define MAX_PIDS 8
+#define MAX_THREADS 64
+#define MSG_SIZE 64
+#define TCP_TIMEOUT_MS 1000
+#define UDP_TIMEOUT_MS 100
+#define HIST_SUB_BITS 3                   /* 8 buckets per power of two */
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define TREND_MIN_R 0.8                   /* correlation of a real trend */
+#define TREND_MIN_GROWTH 0.05             /* growth over the run / mean */
+
+
+/* Latency histogram of one interval, log-linear buckets of ns. */
+struct hist {
+  _Atomic uint64_t b[HIST_BUCKETS];
+  _Atomic uint64_t errors;
+};
+
+/* Load configuration, set once in main(). */
+struct soak_cfg {
+  struct sockaddr_in tcp_addr, udp_addr;
+  int tcp_threads, udp_threads;
+  long churn;                             /* requests per TCP connection */
+  long rate;                              /* requests/s of every thread */
+};
+
+/* One sampled series and its samples (one per interval). */
+struct series {
+  const char *name;
+  const char *unit;
+  double *v;
+  size_t n, cap;
+};
+
+/* Series of one server process. */
+struct proc_series {
+  pid_t pid;
+  struct series rss, fds, tcp_q, udp_q, udp_drops;
+};
+
+
+static struct soak_cfg cfg;
+static struct hist hists[2];              /* [0] TCP, [1] UDP */
+static _Atomic int stop;
+
+
+/**************************** FUNCTIONS *******************************/
+
+/**
+ * Function print help for user.
+ */
+void print_info();
+
+
+/**
+ * TCP load thread: connect, send cfg.churn paced echo requests, close
+ * and connect again.
+ *
+ * @param arg is unused
+ */
+void *tcp_load_func(void *arg);
+
+
+/**
+ * UDP load thread: paced requests, each waits for the reply.
+ *
+ * @param arg is unused
+ */
+void *udp_load_func(void *arg);
+
+
+/**
+ * Function open UDP load socket connected to the server, with the reply
+ * timeout. A new socket (source port) after a timeout keeps the late
+ * reply from answering the next request: replies carry no request
+ * number.
+ *
+ * @return socket descriptor or -1 on error
+ */
+int udp_load_socket(void);
+
+
+/**
+ * Function sleep until the next request of a paced thread. Schedule is
+ * kept after a stall, late requests go out back to back until the
+ * thread catches up.
+ *
+ * @param next is a time of the next request, advanced by the period
+ * @return scheduled time of the request in ns, now if not paced
+ */
+uint64_t pace(struct timespec *next);
+
+
+/**
+ * Function add latency to the histogram.
+ */
+void hist_add(struct hist *h, uint64_t ns);
+
+
+/**
+ * Function take and clear histogram of the finished interval.
+ *
+ * @param h is a histogram
+ * @param pct is an array of percentiles (0..1) to compute
+ * @param out is an array of results in microseconds
+ * @param n is a number of percentiles
+ * @param errors is a number of failed requests
+ * @return number of samples
+ */
+uint64_t hist_take(struct hist *h, const double *pct, double *out, int n, uint64_t *errors);
+
+
+/**
+ * Function sample one server process.
+ *
+ * @return 0 on success, -1 if the process is gone
+ */
+int sample_proc(struct proc_series *p);
+
+
+/**
+ * Function add value to the series.
+ */
+void series_add(struct series *s, double v);
+
+
+/**
+ * Function fit least squares line to the series and print slope per
+ * hour, correlation and verdict.
+ *
+ * @param s is a series
+ * @param interval is a sampling interval in seconds
+ * @return true if the series grows
+ */
+bool series_trend(const struct series *s, double interval);
+
+
+/**
+ * Function return monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+
+void stop_handler(int sig);
+
+/**********************************************************************/
+
+
+int main(int argc, char **argv) {
+
+  /* Set default IP address of the servers. */
+  char serv_ip[INET_ADDRSTRLEN] = SERV_IP;
+
+  /* Ports, zero disables the protocol. */
+  int tcp_port = 0, udp_port = 0;
+
+  /* Sampled servers. */
+  struct proc_series procs[MAX_PIDS] = {};
+  int n_procs = 0;
+
+  /* One hour of one minute intervals by default. */
+  long duration = 3600, interval = 60;
+
+  cfg.tcp_threads = 1;
+  cfg.udp_threads = 1;
+  cfg.churn = 100;
+  cfg.rate = 1000;
+
+  /* Parsing user arguments. */
+  int c, prev_ind;
+
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":i:t:u:P:d:I:c:U:r:q:h")) != -1 ) {
+	/* Case for "soak -t -u". */
+	if ( optind == prev_ind + 2 && *optarg == '-' ) {
+	  c = ':';
+	  --optind;
+	}
+	/* Other cases. */
+	switch ( c ) {
+	  case 'h':
+		print_info();
+		exit(1);
+	  case 'i':
+		snprintf(serv_ip, sizeof(serv_ip), "%s", optarg);
+		break;
+	  case 't':
+		tcp_port = atoi(optarg);
+		break;
+	  case 'u':
+		udp_port = atoi(optarg);
+		break;
+	  case 'P':
+		if ( n_procs == MAX_PIDS ) {
+		  fprintf(stderr, "At most %d processes.\n", MAX_PIDS);
+		  exit(1);
+		}
+		procs[n_procs++].pid = atoi(optarg);
+		break;
+	  case 'd':
+		duration = atol(optarg);
+		break;
+	  case 'I':
+		interval = atol(optarg);
+		break;
+	  case 'c':
+		cfg.tcp_threads = atoi(optarg);
+		break;
+	  case 'U':
+		cfg.udp_threads = atoi(optarg);
+		break;
+	  case 'r':
+		cfg.churn = atol(optarg);
+		break;
+	  case 'q':
+		cfg.rate = atol(optarg);
+		break;
+	  case ':':
+		printf("Option needs a value.\n");
+		exit(1);
+	  case '?':
+		fprintf(stderr, "Unknown option: %c.\n", optopt);
+		exit(1);
+	}
+  }
+
+  if ( (tcp_port == 0 && udp_port == 0) || interval <= 0 || duration < interval ||
+       cfg.tcp_threads < 0 || cfg.tcp_threads > MAX_THREADS ||
+       cfg.udp_threads < 0 || cfg.udp_threads > MAX_THREADS || cfg.churn < 1 ) {
+    fprintf(stderr, "Wrong parameters, see -h.\n");
+    exit(1);
+  }
+  if ( tcp_port == 0 ) {
+    cfg.tcp_threads = 0;
+  }
+  if ( udp_port == 0 ) {
+    cfg.udp_threads = 0;
+  }
+
+  cfg.tcp_addr.sin_family = cfg.udp_addr.sin_family = AF_INET;
+  cfg.tcp_addr.sin_port = htons(tcp_port);
+  cfg.udp_addr.sin_port = htons(udp_port);
+  if ( inet_pton(AF_INET, serv_ip, &cfg.tcp_addr.sin_addr) <= 0 ) {
+    fprintf(stderr, "ERROR inet_pton(): %s\n", strerror(errno));
+    exit(1);
+  }
+  cfg.udp_addr.sin_addr = cfg.tcp_addr.sin_addr;
+
+  for ( int i = 0; i < n_procs; i++ ) {
+    struct proc_series *p = &procs[i];
+    p->rss.name = "RSS";             p->rss.unit = "KiB";
+    p->fds.name = "open fds";        p->fds.unit = "";
+    p->tcp_q.name = "TCP queues";    p->tcp_q.unit = "B";
+    p->udp_q.name = "UDP queues";    p->udp_q.unit = "B";
+    p->udp_drops.name = "UDP drops"; p->udp_drops.unit = "";
+  }
+
+  struct series lat[2][3] = {
+    { { .name = "TCP p50", .unit = "us" }, { .name = "TCP p99", .unit = "us" },
+      { .name = "TCP p99.9", .unit = "us" } },
+    { { .name = "UDP p50", .unit = "us" }, { .name = "UDP p99", .unit = "us" },
+      { .name = "UDP p99.9", .unit = "us" } }
+  };
+
+  /* Ctrl-C ends the run early, the report is still printed. */
+  struct sigaction sa = { .sa_handler = stop_handler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_t threads[2 * MAX_THREADS];
+  int n_threads = 0;
+  for ( int i = 0; i < cfg.tcp_threads + cfg.udp_threads; i++ ) {
+    if ( pthread_create(&threads[n_threads++], NULL,
+                        i < cfg.tcp_threads ? tcp_load_func : udp_load_func, NULL) != 0 ) {
+      fprintf(stderr, "ERROR pthread_create()\n");
+      exit(2);
+    }
+  }
+
+  printf("%6s %5s %10s %6s %10s %10s %8s %9s %9s %9s %8s %9s %9s %9s %8s\n",
+         "time", "pid", "rss[KiB]", "fds", "tcp_q[B]", "udp_q[B]", "udp_drp",
+         "tcp_p50", "tcp_p99", "tcp_p999", "tcp_err", "udp_p50", "udp_p99", "udp_p999", "udp_err");
+
+  const double pct[3] = { 0.5, 0.99, 0.999 };
+  long elapsed = 0;
+  uint64_t start = now_ns();
+
+  while ( !atomic_load(&stop) && elapsed < duration ) {
+
+    /* Sleep to the end of the interval, a signal ends it early. */
+    uint64_t end = start + (elapsed + interval) * 1000000000ULL;
+    struct timespec ts = { end / 1000000000ULL, end % 1000000000ULL };
+    if ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 ) {
+      break;
+    }
+    elapsed += interval;
+
+    double p[2][3];
+    uint64_t errors[2], samples[2];
+    for ( int k = 0; k < 2; k++ ) {
+      samples[k] = hist_take(&hists[k], pct, p[k], 3, &errors[k]);
+      if ( samples[k] > 0 ) {
+        for ( int j = 0; j < 3; j++ ) {
+          series_add(&lat[k][j], p[k][j]);
+        }
+      }
+    }
+
+    for ( int i = 0; i < (n_procs ? n_procs : 1); i++ ) {
+      struct proc_series *ps = &procs[i];
+      if ( n_procs && sample_proc(ps) < 0 ) {
+        fprintf(stderr, "Process %d is gone.\n", (int) ps->pid);
+        atomic_store(&stop, 1);
+        break;
+      }
+      printf("%6ld %5d %10.0f %6.0f %10.0f %10.0f %8.0f",
+             elapsed, n_procs ? (int) ps->pid : 0,
+             n_procs ? ps->rss.v[ps->rss.n - 1] : 0, n_procs ? ps->fds.v[ps->fds.n - 1] : 0,
+             n_procs ? ps->tcp_q.v[ps->tcp_q.n - 1] : 0, n_procs ? ps->udp_q.v[ps->udp_q.n - 1] : 0,
+             n_procs ? ps->udp_drops.v[ps->udp_drops.n - 1] : 0);
+      for ( int k = 0; k < 2; k++ ) {
+        if ( samples[k] > 0 ) {
+          printf(" %9.1f %9.1f %9.1f %8llu", p[k][0], p[k][1], p[k][2], (unsigned long long) errors[k]);
+        } else {
+          printf(" %9s %9s %9s %8llu", "-", "-", "-", (unsigned long long) errors[k]);
+        }
+      }
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+
+  atomic_store(&stop, 1);
+  for ( int i = 0; i < n_threads; i++ ) {
+    pthread_join(threads[i], NULL);
+  }
+
+  /* Trends of the whole run. */
+  int growing = 0;
+  printf("\nTrends over %ld s (%s slope per hour, r = correlation):\n", elapsed,
+         "least squares");
+  for ( int i = 0; i < n_procs; i++ ) {
+    struct proc_series *ps = &procs[i];
+    printf("process %d:\n", (int) ps->pid);
+    growing += series_trend(&ps->rss, interval);
+    growing += series_trend(&ps->fds, interval);
+    growing += series_trend(&ps->tcp_q, interval);
+    growing += series_trend(&ps->udp_q, interval);
+    growing += series_trend(&ps->udp_drops, interval);
+  }
+  printf("load:\n");
+  for ( int k = 0; k < 2; k++ ) {
+    for ( int j = 0; j < 3; j++ ) {
+      growing += series_trend(&lat[k][j], interval);
+    }
+  }
+  printf("\n%d series growing.\n", growing);
+
+  return growing ? 3 : 0;
+}
+
+
+/*********************** FUNCTIONS DEFINITIONS ************************/
+
+void print_info() {
+	printf("Usage: soak -[OPTION] [VALUE]\n");
+	printf("       soak -[OPTION]... -[OPTION] [VALUE]...\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("       -h            show this help\n");
+	printf("       -i [ip]       set ip address of servers (default ip is \"127.0.0.1\")\n");
+	printf("       -t [port]     tcp_echo_serv port (TCP load off if not set)\n");
+	printf("       -u [port]     udp_serv port (UDP load off if not set)\n");
+	printf("       -P [pid]      sample server process (repeatable)\n");
+	printf("       -d [sec]      duration of the run (default 3600)\n");
+	printf("       -I [sec]      sampling interval (default 60)\n");
+	printf("       -c [count]    TCP load threads (default 1)\n");
+	printf("       -U [count]    UDP load threads (default 1)\n");
+	printf("       -r [count]    requests per TCP connection (default 100)\n");
+	printf("       -q [rate]     requests per second of every thread (default 1000)\n");
+	printf("\n");
+	printf("Exit status is 3 if some series keeps growing.\n");
+	printf("\n");
+}
+
+
+void *tcp_load_func(void *arg) {
+  (void) arg;
+  char msg[MSG_SIZE], buf[MSG_SIZE];
+  struct timespec next;
+
+  memset(msg, 'x', sizeof(msg));
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while ( !atomic_load(&stop) ) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = { TCP_TIMEOUT_MS / 1000, (TCP_TIMEOUT_MS % 1000) * 1000 };
+    if ( fd < 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+         connect(fd, (struct sockaddr*) &cfg.tcp_addr, sizeof(cfg.tcp_addr)) < 0 ) {
+      atomic_fetch_add(&hists[0].errors, 1);
+      if ( fd >= 0 ) {
+        close(fd);
+      }
+      pace(&next);
+      continue;
+    }
+
+    for ( long i = 0; i < cfg.churn && !atomic_load(&stop); i++ ) {
+      uint64_t t0 = pace(&next);
+
+      /* Request and the whole echo, a timed out read is an error. */
+      bool ok = write(fd, msg, sizeof(msg)) == sizeof(msg);
+      size_t got = 0;
+      while ( ok && got < sizeof(buf) ) {
+        ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+        ok = n > 0;
+        got += ok ? n : 0;
+      }
+      if ( !ok ) {
+        atomic_fetch_add(&hists[0].errors, 1);
+        break;
+      }
+      hist_add(&hists[0], now_ns() - t0);
+    }
+    close(fd);
+  }
+
+  return NULL;
+}
+
+
+void *udp_load_func(void *arg) {
+  (void) arg;
+  char msg[MSG_SIZE], buf[MSG_SIZE];
+  struct timespec next;
+
+  memset(msg, 'x', sizeof(msg));
+  msg[sizeof(msg) - 1] = '\0';
+
+  int fd = udp_load_socket();
+  if ( fd < 0 ) {
+    fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+    exit(2);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while ( !atomic_load(&stop) ) {
+    uint64_t t0 = pace(&next);
+
+    if ( send(fd, msg, sizeof(msg), 0) < 0 ) {
+      atomic_fetch_add(&hists[1].errors, 1);
+      continue;
+    }
+    if ( recv(fd, buf, sizeof(buf), 0) < 0 ) {
+      atomic_fetch_add(&hists[1].errors, 1);
+      /* Late reply goes to the closed port. */
+      close(fd);
+      if ( (fd = udp_load_socket()) < 0 ) {
+        fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+        exit(2);
+      }
+      continue;
+    }
+    hist_add(&hists[1], now_ns() - t0);
+  }
+  close(fd);
+
+  return NULL;
+}
+
+
+int udp_load_socket(void) {
+  struct timeval tv = { 0, UDP_TIMEOUT_MS * 1000 };
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if ( fd < 0 ) {
+    return -1;
+  }
+  if ( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+       connect(fd, (struct sockaddr*) &cfg.udp_addr, sizeof(cfg.udp_addr)) < 0 ) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+uint64_t pace(struct timespec *next) {
+  if ( cfg.rate <= 0 ) {
+    return now_ns();
+  }
+
+  next->tv_nsec += 1000000000L / cfg.rate;
+  while ( next->tv_nsec >= 1000000000L ) {
+    next->tv_nsec -= 1000000000L;
+    next->tv_sec++;
+  }
+
+  /* Behind schedule (stall) it returns at once. Restarting the schedule
+   * from now would drop the requests the stall delayed, and with them
+   * the latency it caused. */
+  while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR ) {
+  }
+
+  return (uint64_t) next->tv_sec * 1000000000ULL + next->tv_nsec;
+}
+
+
+void hist_add(struct hist *h, uint64_t ns) {
+  int idx;
+
+  /* Values below 2^SUB are exact, above that 8 buckets per octave. */
+  if ( ns < (1 << HIST_SUB_BITS) ) {
+    idx = ns;
+  } else {
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+  }
+  atomic_fetch_add_explicit(&h->b[idx], 1, memory_order_relaxed);
+}
+
+
+uint64_t hist_take(struct hist *h, const double *pct, double *out, int n, uint64_t *errors) {
+  static uint64_t counts[HIST_BUCKETS];
+  uint64_t total = 0;
+
+  for ( int i = 0; i < HIST_BUCKETS; i++ ) {
+    counts[i] = atomic_exchange_explicit(&h->b[i], 0, memory_order_relaxed);
+    total += counts[i];
+  }
+  *errors = atomic_exchange(&h->errors, 0);
+
+  for ( int k = 0; k < n; k++ ) {
+    uint64_t rank = (uint64_t) (pct[k] * total), seen = 0;
+    out[k] = 0;
+    for ( int i = 0; i < HIST_BUCKETS; i++ ) {
+      seen += counts[i];
+      if ( seen > rank ) {
+        /* Upper bound of the bucket. */
+        int octave = i >> HIST_SUB_BITS, sub = i & ((1 << HIST_SUB_BITS) - 1);
+        double hi = octave == 0 ? sub + 1 :
+                    ldexp((1 << HIST_SUB_BITS) + sub + 1, octave - 1);
+        out[k] = hi / 1e3;
+        break;
+      }
+    }
+  }
+
+  return total;
+}
+
+
+int sample_proc(struct proc_series *p) {
+  char path[64], line[512];
+  FILE *f;
+
+  /* Resident set size. */
+  snprintf(path, sizeof(path), "/proc/%d/status", (int) p->pid);
+  if ( (f = fopen(path, "r")) == NULL ) {
+    return -1;
+  }
+  double rss = 0;
+  while ( fgets(line, sizeof(line), f) ) {
+    if ( strncmp(line, "VmRSS:", 6) == 0 ) {
+      rss = atof(line + 6);
+    }
+  }
+  fclose(f);
+
+  /* Open descriptors, socket inodes are kept for the queue lookup. */
+  snprintf(path, sizeof(path), "/proc/%d/fd", (int) p->pid);
+  DIR *dir = opendir(path);
+  if ( dir == NULL ) {
+    return -1;
+  }
+  unsigned long *inodes = NULL;
+  size_t n_fds = 0, n_inodes = 0, cap = 0;
+  struct dirent *de;
+  while ( (de = readdir(dir)) != NULL ) {
+    if ( de->d_name[0] == '.' ) {
+      continue;
+    }
+    n_fds++;
+
+    char link[64 + sizeof(de->d_name)], target[64];
+    snprintf(link, sizeof(link), "%s/%s", path, de->d_name);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    unsigned long ino;
+    if ( len > 0 && (target[len] = '\0', sscanf(target, "socket:[%lu]", &ino) == 1) ) {
+      if ( n_inodes == cap ) {
+        cap = cap ? cap * 2 : 64;
+        inodes = realloc(inodes, cap * sizeof(*inodes));
+        if ( inodes == NULL ) {
+          fprintf(stderr, "ERROR realloc(): %s\n", strerror(errno));
+          exit(2);
+        }
+      }
+      inodes[n_inodes++] = ino;
+    }
+  }
+  closedir(dir);
+
+  /* Queued bytes (and UDP drops) of the sockets of the process. */
+  double queued[2] = {}, drops = 0;
+  const char *tables[2] = { "net/tcp", "net/udp" };
+  for ( int t = 0; t < 2; t++ ) {
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int) p->pid, tables[t]);
+    if ( (f = fopen(path, "r")) == NULL ) {
+      continue;
+    }
+    fgets(line, sizeof(line), f);
+    while ( fgets(line, sizeof(line), f) ) {
+      unsigned long tx, rx, ino, drop = 0;
+      if ( sscanf(line, "%*d: %*x:%*x %*x:%*x %*x %lx:%lx %*x:%*x %*x %*u %*u %lu %*d %*x %lu",
+                  &tx, &rx, &ino, &drop) < 3 ) {
+        continue;
+      }
+      for ( size_t i = 0; i < n_inodes; i++ ) {
+        if ( inodes[i] == ino ) {
+          queued[t] += tx + rx;
+          drops += t == 1 ? drop : 0;
+          break;
+        }
+      }
+    }
+    fclose(f);
+  }
+  free(inodes);
+
+  series_add(&p->rss, rss);
+  series_add(&p->fds, n_fds);
+  series_add(&p->tcp_q, queued[0]);
+  series_add(&p->udp_q, queued[1]);
+  series_add(&p->udp_drops, drops);
+
+  return 0;
+}
+
+
+void series_add(struct series *s, double v) {
+  if ( s->n == s->cap ) {
+    s->cap = s->cap ? s->cap * 2 : 256;
+    s->v = realloc(s->v, s->cap * sizeof(double));
+    if ( s->v == NULL ) {
+      fprintf(stderr, "ERROR realloc(): %s\n", strerror(errno));
+      exit(2);
+    }
+  }
+  s->v[s->n++] = v;
+}
+
+
+bool series_trend(const struct series *s, double interval) {
+  if ( s->n < 3 ) {
+    printf("  %-12s not enough samples\n", s->name);
+    return false;
+  }
+
+  /* Least squares over x = sample index. */
+  double mx = (s->n - 1) / 2.0, my = 0;
+  for ( size_t i = 0; i < s->n; i++ ) {
+    my += s->v[i];
+  }
+  my /= s->n;
+
+  double sxy = 0, sxx = 0, syy = 0;
+  for ( size_t i = 0; i < s->n; i++ ) {
+    sxy += (i - mx) * (s->v[i] - my);
+    sxx += (i - mx) * (i - mx);
+    syy += (s->v[i] - my) * (s->v[i] - my);
+  }
+  double slope = sxy / sxx;
+  double r = syy > 0 ? sxy / sqrt(sxx * syy) : 0;
+  double growth = slope * (s->n - 1);
+
+  /* Growing: consistent (r) and not negligible against the level. */
+  bool up = slope > 0 && r >= TREND_MIN_R && growth >= TREND_MIN_GROWTH * (my > 1 ? my : 1);
+
+  printf("  %-12s mean %12.1f %-3s slope %+12.2f %-3s/h  r %+.2f  %s\n",
+         s->name, my, s->unit, slope * 3600 / interval, s->unit, r, up ? "GROWING" : "stable");
+
+  return up;
+}
+
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void stop_handler(int sig) {
+  (void) sig;
+  atomic_store(&stop, 1);
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# File:         soak.sh
+# Authors:      Marcin ********
+# Date:         19.10.2026
+# Description:  Script runs soak test: tcp_echo_serv and udp_serv get
+#               steady mixed load with TCP connection churn for hours,
+#               soak samples their RSS, descriptors, socket queues and
+#               latency every interval and reports growing series.
+#               Exit status is 3 if something keeps growing.
+#
+# Usage:        soak.sh [seconds] [interval] [rate]
+
+DURATION=${1:-7200}
+INTERVAL=${2:-60}
+RATE=${3:-1000}
+TCP_PORT=9140
+UDP_PORT=9141
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$(mktemp -d)
+
+gcc -O2 -pthread -o "$BIN/tcp_echo_serv" "$SRC/TCP/tcp_echo_serv.c" || exit 1
+gcc -O2 -pthread -o "$BIN/udp_serv" "$SRC/UDP/udp_serv.c" || exit 1
+gcc -O2 -pthread -o "$BIN/soak" "$SRC/BENCH/soak.c" -lm || exit 1
+
+"$BIN/tcp_echo_serv" -p $TCP_PORT > /dev/null &
+TCP_PID=$!
+"$BIN/udp_serv" -p $UDP_PORT > /dev/null &
+UDP_PID=$!
+sleep 0.5
+
+# One TCP thread: tcp_echo_serv serves connections one by one.
+"$BIN/soak" -t $TCP_PORT -u $UDP_PORT -P $TCP_PID -P $UDP_PID \
+            -d "$DURATION" -I "$INTERVAL" -q "$RATE" -c 1 -U 2 -r 100
+STATUS=$?
+
+kill $TCP_PID $UDP_PID
+rm -rf "$BIN"
+exit $STATUS
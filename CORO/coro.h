@@ -0,0 +1,345 @@
+/* File:         coro.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Stackless coroutines for connection handlers and the
+ *               event engines that drive them.
+ *
+ *               A handler is a function written as straight-line
+ *               code between CORO_BEGIN() and CORO_END(). It suspends
+ *               with CORO_AWAIT() when a non-blocking call would block
+ *               and is resumed by the engine when the descriptor is
+ *               ready. Only the resume point is kept, so locals do not
+ *               survive a suspension: everything that has to be
+ *               remembered lives in the handler's state structure,
+ *               which starts with struct coro (a few dozen bytes per
+ *               connection). A handler must not use switch statements
+ *               around its suspension points.
+ *
+ *               Engines: CORO_POLL (poll(), O(n) per wait) and
+ *               CORO_EPOLL (level-triggered epoll). One engine runs in
+ *               one thread.
+ *
+ *               Coroutines are allocated with malloc(). When a handler
+ *               finishes, the engine closes its descriptor and frees it.
+ *               struct coro_acceptor spawns a handler coroutine for
+ *               every connection of a listening socket.
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define CORO_MAX_FDS (1 << 20)  /* cap of the engine descriptor tables */
+
+/* What a suspended coroutine waits for, returned by the handler. */
+enum coro_wait {
+  CORO_DONE = 0,
+  CORO_READ = POLLIN,
+  CORO_WRITE = POLLOUT
+};
+
+enum coro_engine_kind {
+  CORO_POLL,
+  CORO_EPOLL
+};
+
+struct coro;
+typedef int (*coro_fn)(struct coro *c);
+
+/* Header of every coroutine state. */
+struct coro {
+  coro_fn fn;                   /* handler */
+  ssize_t ret;                  /* result of the last CORO_AWAIT() call */
+  int fd;
+  uint16_t pc;                  /* resume point, 0 = start */
+  uint8_t wait;                 /* enum coro_wait of the registration */
+};
+
+/* Event engine. */
+struct coro_engine {
+  enum coro_engine_kind kind;
+  int max_fds;
+  struct coro **by_fd;          /* registered coroutine of the descriptor */
+  int n;                        /* registered coroutines */
+  struct pollfd *pfd;           /* CORO_POLL: dense array of descriptors */
+  int *slot;                    /* CORO_POLL: index in pfd of a descriptor */
+  int epfd;                     /* CORO_EPOLL */
+  struct epoll_event *events;
+  const sigset_t *sigmask;      /* signal mask while waiting, NULL = keep */
+  uint64_t resumes;
+};
+
+/* Coroutine of a listening socket. */
+struct coro_acceptor {
+  struct coro co;
+  struct coro_engine *e;
+  coro_fn handler;              /* handler of accepted connections */
+  size_t size;                  /* size of its state, starts with struct coro */
+  int reserve;                  /* spare descriptor for EMFILE, opened by the handler */
+  bool starved;                 /* out of descriptors, reported once */
+};
+
+
+#define CORO_BEGIN(c)      switch ( (c)->pc ) { case 0:
+
+/* Suspend until the descriptor is ready for ev. */
+#define CORO_YIELD(c, ev) \
+  do { (c)->pc = __LINE__; return (ev); case __LINE__:; } while (0)
+
+/* Run non-blocking call, suspend and retry while it would block. Result
+ * is in (c)->ret. */
+#define CORO_AWAIT(c, ev, call) \
+  while ( ((c)->ret = (call)) < 0 && (errno == EAGAIN || errno == EINTR) ) \
+    CORO_YIELD(c, ev)
+
+#define CORO_END(c)        } (c)->pc = 0; return CORO_DONE
+
+
+/**
+ * Function prepare engine.
+ *
+ * @param kind is CORO_POLL or CORO_EPOLL
+ * @param max_fds is a limit of descriptor numbers
+ * @return 0 on success, -1 on error
+ */
+static inline int coro_engine_init(struct coro_engine *e, enum coro_engine_kind kind, int max_fds) {
+  memset(e, 0, sizeof(*e));
+  e->kind = kind;
+  e->max_fds = max_fds;
+  e->epfd = -1;
+  e->by_fd = calloc(max_fds, sizeof(struct coro *));
+  if ( e->by_fd == NULL ) {
+    return -1;
+  }
+
+  if ( kind == CORO_POLL ) {
+    e->pfd = calloc(max_fds, sizeof(struct pollfd));
+    e->slot = calloc(max_fds, sizeof(int));
+    return e->pfd && e->slot ? 0 : -1;
+  }
+
+  e->epfd = epoll_create1(EPOLL_CLOEXEC);
+  e->events = calloc(max_fds, sizeof(struct epoll_event));
+  return e->epfd >= 0 && e->events ? 0 : -1;
+}
+
+
+/**
+ * Function return descriptor limit for coro_engine_init(): soft
+ * RLIMIT_NOFILE, at most CORO_MAX_FDS. The engine allocates tables of
+ * that many entries, the limit may be RLIM_INFINITY or just huge.
+ */
+static inline int coro_fd_limit(void) {
+  struct rlimit rl;
+
+  if ( getrlimit(RLIMIT_NOFILE, &rl) < 0 ) {
+    return 1024;
+  }
+  if ( rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > CORO_MAX_FDS ) {
+    return CORO_MAX_FDS;
+  }
+  return rl.rlim_cur;
+}
+
+
+/**
+ * Function register coroutine or change what it waits for.
+ */
+static inline int coro_watch(struct coro_engine *e, struct coro *c, int wait) {
+  if ( e->kind == CORO_POLL ) {
+    if ( e->by_fd[c->fd] == NULL ) {
+      e->slot[c->fd] = e->n;
+      e->pfd[e->n].fd = c->fd;
+      e->pfd[e->n].revents = 0;
+    }
+    e->pfd[e->slot[c->fd]].events = wait;
+  } else if ( c->wait != wait || e->by_fd[c->fd] == NULL ) {
+    struct epoll_event ev = { .events = wait == CORO_READ ? EPOLLIN : EPOLLOUT, .data.ptr = c };
+    if ( epoll_ctl(e->epfd, e->by_fd[c->fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0 ) {
+      fprintf(stderr, "ERROR epoll_ctl(): %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  if ( e->by_fd[c->fd] == NULL ) {
+    e->by_fd[c->fd] = c;
+    e->n++;
+  }
+  c->wait = wait;
+
+  return 0;
+}
+
+
+/**
+ * Function remove coroutine from the engine, descriptor stays open.
+ */
+static inline void coro_remove(struct coro_engine *e, struct coro *c) {
+  if ( e->by_fd[c->fd] != c ) {
+    return;
+  }
+  if ( e->kind == CORO_POLL ) {
+    /* Last descriptor fills the hole. */
+    int s = e->slot[c->fd];
+    e->pfd[s] = e->pfd[e->n - 1];
+    e->slot[e->pfd[s].fd] = s;
+  } else {
+    epoll_ctl(e->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  }
+  e->by_fd[c->fd] = NULL;
+  e->n--;
+}
+
+
+/**
+ * Function resume coroutine and handle what it returned.
+ */
+static inline void coro_resume(struct coro_engine *e, struct coro *c) {
+  int wait = c->fn(c);
+
+  e->resumes++;
+  if ( wait == CORO_DONE || coro_watch(e, c, wait) < 0 ) {
+    coro_remove(e, c);
+    close(c->fd);
+    free(c);
+  }
+}
+
+
+/**
+ * Function start coroutine on its (non-blocking) descriptor: run it
+ * until the first suspension.
+ *
+ * @return 0 on success, -1 if the descriptor is out of range (the
+ *         coroutine is freed and descriptor closed)
+ */
+static inline int coro_spawn(struct coro_engine *e, struct coro *c) {
+  if ( c->fd < 0 || c->fd >= e->max_fds ) {
+    close(c->fd);
+    free(c);
+    return -1;
+  }
+  c->pc = 0;
+  c->wait = CORO_DONE;
+  coro_resume(e, c);
+
+  return 0;
+}
+
+
+/**
+ * Function resume coroutines whose descriptors are ready. A signal
+ * setting stop should be blocked by the caller and unblocked only by
+ * e->sigmask of the wait, otherwise one arriving just before the wait
+ * is seen only with the next event.
+ *
+ * @param stop is a flag (e.g. set by a signal handler) which ends the
+ *        loop, or NULL
+ * @return when no coroutine is left or stop is set
+ */
+static inline void coro_engine_run(struct coro_engine *e, volatile sig_atomic_t *stop) {
+  while ( e->n > 0 && !(stop && *stop) ) {
+
+    if ( e->kind == CORO_POLL ) {
+      int n = ppoll(e->pfd, e->n, NULL, e->sigmask);
+      if ( n < 0 ) {
+        if ( errno != EINTR ) {
+          fprintf(stderr, "ERROR ppoll(): %s\n", strerror(errno));
+        }
+        continue;
+      }
+      /* Resuming may move descriptors within the array, scan backwards
+       * so that a moved (last) entry was already visited. */
+      for ( int i = e->n - 1; i >= 0 && n > 0; i-- ) {
+        if ( i >= e->n || e->pfd[i].revents == 0 ) {
+          continue;
+        }
+        e->pfd[i].revents = 0;
+        n--;
+        coro_resume(e, e->by_fd[e->pfd[i].fd]);
+      }
+    } else {
+      int n = epoll_pwait(e->epfd, e->events, e->max_fds, -1, e->sigmask);
+      if ( n < 0 ) {
+        if ( errno != EINTR ) {
+          fprintf(stderr, "ERROR epoll_pwait(): %s\n", strerror(errno));
+        }
+        continue;
+      }
+      for ( int i = 0; i < n; i++ ) {
+        coro_resume(e, e->events[i].data.ptr);
+      }
+    }
+  }
+}
+
+/**
+ * Acceptor handler: accept connections and spawn their coroutines
+ * (state zeroed, descriptor non-blocking).
+ *
+ * Out of descriptors the pending connection stays queued and the
+ * level-triggered socket stays ready, so the engine would spin. The
+ * acceptor keeps a reserve descriptor instead: it frees it, accepts
+ * and closes the connection (the client sees a reset instead of a
+ * hang) and takes the reserve again.
+ */
+static inline int coro_accept_fn(struct coro *c) {
+  struct coro_acceptor *a = (struct coro_acceptor *) c;
+
+  CORO_BEGIN(c);
+  a->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  while ( 1 ) {
+    CORO_AWAIT(c, CORO_READ, accept4(c->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC));
+    if ( c->ret < 0 ) {
+      int err = errno;
+      if ( (err == EMFILE || err == ENFILE) && a->reserve < 0 ) {
+        a->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      }
+      if ( (err == EMFILE || err == ENFILE) && a->reserve >= 0 ) {
+        if ( !a->starved ) {
+          fprintf(stderr, "ERROR accept(): %s, refusing connections\n", strerror(err));
+          a->starved = true;
+        }
+        close(a->reserve);
+        int fd = accept(c->fd, NULL, NULL);
+        if ( fd >= 0 ) {
+          close(fd);
+        }
+        a->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      } else {
+        fprintf(stderr, "ERROR accept(): %s\n", strerror(err));
+      }
+      CORO_YIELD(c, CORO_READ);
+      continue;
+    }
+    if ( a->starved ) {
+      fprintf(stderr, "Accepting connections again.\n");
+      a->starved = false;
+    }
+
+    struct coro *h = calloc(1, a->size);
+    if ( h == NULL ) {
+      close(c->ret);
+      continue;
+    }
+    h->fn = a->handler;
+    h->fd = c->ret;
+    coro_spawn(a->e, h);
+  }
+  CORO_END(c);
+}
+
+#endif /* CORO_H */
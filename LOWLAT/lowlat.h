@@ -0,0 +1,124 @@
+/* File:         lowlat.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Low latency setup shared by the echo and UDP servers:
+ *               CPU pinning of the serving threads, busy polling of
+ *               sockets (SO_BUSY_POLL) and locked, prefaulted memory.
+ *
+ *               parse_cpus()       CPU list of the -C option
+ *               pin_thread()       pin calling thread, round robin
+ *               busy_poll_setup()  non-blocking socket with busy poll
+ *               lock_memory()      mlockall() and stack prefault
+ */
+
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define MAX_CPUS 64
+#define STACK_PREFAULT (256 * 1024)
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+/* CPUs for pinning, set once in main(). */
+static int cpus[MAX_CPUS];
+static int n_cpus;
+static _Atomic unsigned next_cpu;
+
+
+/**
+ * Function parse comma separated list of CPUs for pinning.
+ *
+ * @param list is a list of CPUs, e.g. "2,3"
+ * @return 0 on success, -1 on error
+ */
+static inline int parse_cpus(const char *list) {
+  char *end;
+
+  while ( *list ) {
+    long cpu = strtol(list, &end, 10);
+    if ( end == list || cpu < 0 || cpu >= CPU_SETSIZE || n_cpus == MAX_CPUS ) {
+      return -1;
+    }
+    if ( *end != ',' && *end != '\0' ) {
+      return -1;
+    }
+    cpus[n_cpus++] = cpu;
+    list = *end == ',' ? end + 1 : end;
+  }
+
+  return n_cpus > 0 ? 0 : -1;
+}
+
+
+/**
+ * Function pin calling thread to the next CPU from the list
+ * (round robin). Does nothing if no CPUs were given.
+ */
+static inline void pin_thread(void) {
+  if ( n_cpus == 0 ) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[atomic_fetch_add(&next_cpu, 1) % n_cpus], &set);
+
+  if ( sched_setaffinity(0, sizeof(set), &set) < 0 ) {
+    fprintf(stderr, "ERROR sched_setaffinity(): %s\n", strerror(errno));
+  }
+}
+
+
+/**
+ * Function switch socket to non-blocking busy polling mode. Raising
+ * the budget above net.core.busy_read needs CAP_NET_ADMIN, without it
+ * only a warning is printed (once) and the caller spins in user space.
+ *
+ * @param fd is a socket descriptor
+ * @param usec is a busy poll budget of one receive
+ */
+static inline void busy_poll_setup(int fd, int usec) {
+  static _Atomic bool warned;
+  int prefer = 1;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  if ( (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) &&
+       !atomic_exchange(&warned, true) ) {
+    fprintf(stderr, "WARNING setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
+  }
+}
+
+
+/**
+ * Function lock process memory and prefault the stack of the calling
+ * thread, so the hot path never takes a page fault. Heap allocated
+ * later is locked by MCL_FUTURE when it is mapped.
+ */
+static inline void lock_memory(void) {
+  if ( mlockall(MCL_CURRENT | MCL_FUTURE) < 0 ) {
+    fprintf(stderr, "WARNING mlockall(): %s\n", strerror(errno));
+    return;
+  }
+
+  volatile char stack[STACK_PREFAULT];
+  for ( size_t i = 0; i < sizeof(stack); i += 4096 ) {
+    stack[i] = 0;
+  }
+}
+
+#endif /* LOWLAT_H */
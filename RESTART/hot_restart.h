@@ -0,0 +1,360 @@
+/* File:         hot_restart.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Zero-downtime restart of a server. Old process starts
+ *               a fresh instance of its own binary (same arguments)
+ *               and passes listening sockets, optionally also live
+ *               connections, over a Unix socket with SCM_RIGHTS. When
+ *               the new instance reports it is serving, the old one
+ *               stops taking new work, drains and exits. Queued
+ *               connections and datagrams stay in the shared sockets,
+ *               so nothing is dropped.
+ *
+ *               Old process:  hot_restart_spawn(), hot_restart_send(),
+ *                             hot_restart_wait_ready()
+ *               New process:  hot_restart_recv(), hot_restart_ready()
+ */
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define HOT_RESTART_ENV "NETPROG_RESTART_FD"
+#define HOT_RESTART_MAGIC 0x4e505253u      /* "NPRS" */
+#define HOT_RESTART_MAX_FDS 64
+#define HOT_RESTART_TIMEOUT_MS 10000       /* new instance to report ready */
+
+/* Message carrying the descriptors. */
+struct hot_restart_msg {
+  uint32_t magic;
+  uint32_t n_listen;                        /* listening sockets first */
+  uint32_t n_conn;                          /* then live connections */
+};
+
+/* Channel to the new instance (old side) or to the old one (new side). */
+static int hot_restart_fd = -1;
+
+/* New instance until it reports ready (old side). */
+static pid_t hot_restart_pid = -1;
+
+extern char **environ;
+
+
+/**
+ * Function stop the new instance which did not get ready and close
+ * the channel to it.
+ */
+static void hot_restart_abort(void) {
+  if ( hot_restart_fd >= 0 ) {
+    close(hot_restart_fd);
+    hot_restart_fd = -1;
+  }
+  if ( hot_restart_pid > 0 ) {
+    kill(hot_restart_pid, SIGKILL);
+    while ( waitpid(hot_restart_pid, NULL, 0) < 0 && errno == EINTR ) {
+    }
+    hot_restart_pid = -1;
+  }
+}
+
+
+/**
+ * Function start new instance of the program with the same arguments.
+ * Only the channel descriptor is inherited, sockets are sent later.
+ * Environment is built before fork(), the child of a threaded process
+ * calls only async-signal-safe functions until execve().
+ *
+ * @param argv is an argument vector of main()
+ * @return 0 on success, -1 on error
+ */
+static int hot_restart_spawn(char **argv) {
+  char path[PATH_MAX];
+  char fd_env[sizeof(HOT_RESTART_ENV) + 16];
+  int sv[2];
+
+  /* Path of the binary, not /proc/self/exe: the new process keeps the
+   * program name and a binary replaced on disk (upgrade) is started. */
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if ( len < 0 ) {
+    fprintf(stderr, "ERROR readlink(): %s\n", strerror(errno));
+    return -1;
+  }
+  path[len] = '\0';
+  const char *deleted = " (deleted)";
+  if ( len > (ssize_t) strlen(deleted) && strcmp(path + len - strlen(deleted), deleted) == 0 ) {
+    path[len - strlen(deleted)] = '\0';
+  }
+
+  if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0 ) {
+    fprintf(stderr, "ERROR socketpair(): %s\n", strerror(errno));
+    return -1;
+  }
+
+  /* Environment of the new instance: ours with the channel set. */
+  int n_env = 0;
+  while ( environ[n_env] ) {
+    n_env++;
+  }
+  char **envp = malloc((n_env + 2) * sizeof(char *));
+  if ( envp == NULL ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  int k = 0;
+  for ( int i = 0; i < n_env; i++ ) {
+    if ( strncmp(environ[i], HOT_RESTART_ENV "=", sizeof(HOT_RESTART_ENV)) != 0 ) {
+      envp[k++] = environ[i];
+    }
+  }
+  snprintf(fd_env, sizeof(fd_env), "%s=%d", HOT_RESTART_ENV, sv[1]);
+  envp[k++] = fd_env;
+  envp[k] = NULL;
+
+  /* Highest descriptor for the close_range() fallback. */
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  max_fd = max_fd < 0 ? 1024 : max_fd;
+
+  pid_t pid = fork();
+  if ( pid < 0 ) {
+    fprintf(stderr, "ERROR fork(): %s\n", strerror(errno));
+    free(envp);
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+
+  if ( pid == 0 ) {
+    static const char msg[] = "ERROR execve(): new instance not started\n";
+    sigset_t none;
+
+    /* Signals blocked by the serving threads are not inherited. */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    /* Nothing but stdio and the channel survives exec. */
+    if ( close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) < 0 ) {
+      for ( int fd = 3; fd < max_fd; fd++ ) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+    fcntl(sv[1], F_SETFD, 0);
+
+    execve(path, argv, envp);
+    ssize_t w = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void) w;
+    _exit(127);
+  }
+
+  free(envp);
+  close(sv[1]);
+  hot_restart_fd = sv[0];
+  hot_restart_pid = pid;
+
+  return 0;
+}
+
+
+/**
+ * Function send sockets to the new instance.
+ *
+ * @param listen_fds is an array of listening (or bound) sockets
+ * @param n_listen is a number of listening sockets
+ * @param conn_fds is an array of live connections
+ * @param n_conn is a number of live connections
+ * @return 0 on success, -1 on error
+ */
+static int hot_restart_send(const int *listen_fds, int n_listen, const int *conn_fds, int n_conn) {
+  int n = n_listen + n_conn;
+
+  if ( n == 0 || n > HOT_RESTART_MAX_FDS ) {
+    hot_restart_abort();
+    return -1;
+  }
+
+  struct hot_restart_msg hdr = { HOT_RESTART_MAGIC, n_listen, n_conn };
+  struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+  union {
+    char buf[CMSG_SPACE(HOT_RESTART_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = CMSG_SPACE(n * sizeof(int))
+  };
+
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(cm), listen_fds, n_listen * sizeof(int));
+  memcpy(CMSG_DATA(cm) + n_listen * sizeof(int), conn_fds, n_conn * sizeof(int));
+
+  if ( sendmsg(hot_restart_fd, &msg, 0) != sizeof(hdr) ) {
+    fprintf(stderr, "ERROR sendmsg(SCM_RIGHTS): %s\n", strerror(errno));
+    hot_restart_abort();
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Function wait until the new instance serves the sockets, at most
+ * HOT_RESTART_TIMEOUT_MS. An instance which fails or hangs is killed
+ * and reaped, the old one keeps serving.
+ *
+ * @return 0 if new instance is ready, -1 if it failed
+ */
+static int hot_restart_wait_ready(void) {
+  struct pollfd pfd = { .fd = hot_restart_fd, .events = POLLIN };
+  struct timespec now, end;
+  ssize_t n = -1;
+  char c;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += HOT_RESTART_TIMEOUT_MS / 1000;
+  end.tv_nsec += (HOT_RESTART_TIMEOUT_MS % 1000) * 1000000L;
+  if ( end.tv_nsec >= 1000000000L ) {
+    end.tv_sec++;
+    end.tv_nsec -= 1000000000L;
+  }
+
+  while ( 1 ) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+    if ( ms <= 0 ) {
+      fprintf(stderr, "ERROR: new instance not ready in %d ms.\n", HOT_RESTART_TIMEOUT_MS);
+      break;
+    }
+    int ready = poll(&pfd, 1, ms);
+    if ( ready < 0 && errno != EINTR ) {
+      fprintf(stderr, "ERROR poll(): %s\n", strerror(errno));
+      break;
+    }
+    if ( ready > 0 ) {
+      while ( (n = read(hot_restart_fd, &c, 1)) < 0 && errno == EINTR ) {
+      }
+      break;
+    }
+  }
+
+  if ( n != 1 ) {
+    hot_restart_abort();
+    return -1;
+  }
+  close(hot_restart_fd);
+  hot_restart_fd = -1;
+  hot_restart_pid = -1;
+
+  return 0;
+}
+
+
+/**
+ * Function receive sockets from the old instance, if the program was
+ * started by hot_restart_spawn().
+ *
+ * @param listen_fds is an array for listening sockets
+ * @param n_listen is a number of received listening sockets
+ * @param conn_fds is an array for live connections
+ * @param n_conn is a number of received live connections
+ * @param max is a size of both arrays
+ * @return 1 if sockets were received, 0 if this is a normal start,
+ *         -1 on error
+ */
+static int hot_restart_recv(int *listen_fds, int *n_listen, int *conn_fds, int *n_conn, int max) {
+  const char *env = getenv(HOT_RESTART_ENV);
+
+  *n_listen = *n_conn = 0;
+  if ( env == NULL ) {
+    return 0;
+  }
+  hot_restart_fd = atoi(env);
+  unsetenv(HOT_RESTART_ENV);
+  fcntl(hot_restart_fd, F_SETFD, FD_CLOEXEC);
+
+  struct hot_restart_msg hdr;
+  struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+  union {
+    char buf[CMSG_SPACE(HOT_RESTART_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+
+  if ( recvmsg(hot_restart_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hdr) || hdr.magic != HOT_RESTART_MAGIC ) {
+    fprintf(stderr, "ERROR: no sockets from the old instance.\n");
+    return -1;
+  }
+
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  int n = hdr.n_listen + hdr.n_conn;
+  if ( cm == NULL || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(n * sizeof(int)) ||
+       (int) hdr.n_listen > max || (int) hdr.n_conn > max ) {
+    fprintf(stderr, "ERROR: wrong sockets from the old instance.\n");
+    return -1;
+  }
+  memcpy(listen_fds, CMSG_DATA(cm), hdr.n_listen * sizeof(int));
+  memcpy(conn_fds, CMSG_DATA(cm) + hdr.n_listen * sizeof(int), hdr.n_conn * sizeof(int));
+  *n_listen = hdr.n_listen;
+  *n_conn = hdr.n_conn;
+
+  return 1;
+}
+
+
+/**
+ * Function wait until the descriptor is ready, with the restart signal
+ * unblocked only for the wait. The caller keeps the signal blocked, so
+ * a request which comes after it checked its flag interrupts the wait
+ * instead of waiting for the next event.
+ *
+ * @param events is POLLIN or POLLOUT
+ * @param mask is a signal mask of the wait
+ * @return 0 when ready, -1 on error (EINTR when interrupted)
+ */
+static int hot_restart_wait_fd(int fd, short events, const sigset_t *mask) {
+  struct pollfd pfd = { .fd = fd, .events = events };
+
+  return ppoll(&pfd, 1, NULL, mask) < 0 ? -1 : 0;
+}
+
+
+/**
+ * Function tell the old instance to drain and exit.
+ */
+static void hot_restart_ready(void) {
+  if ( hot_restart_fd < 0 ) {
+    return;
+  }
+  if ( write(hot_restart_fd, "R", 1) != 1 ) {
+    fprintf(stderr, "ERROR write(restart): %s\n", strerror(errno));
+  }
+  close(hot_restart_fd);
+  hot_restart_fd = -1;
+}
+
+#endif /* HOT_RESTART_H */
@@ -0,0 +1,78 @@
+/* File:         kv_proto.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Binary GET/SET/DEL protocol of the tcp_serv key-value
+ *               cache, shared by the server and the tcp_cli load tester.
+ *
+ *               Request:  struct kv_req_hdr, key, value (SET only)
+ *               Response: struct kv_resp_hdr, value (GET hit only)
+ *
+ *               Integers are in network byte order. Requests on one
+ *               connection may be pipelined, responses come in order.
+ *
+ *               Every server worker owns one shard and listens on
+ *               its own port (base port + shard). Client sends a key
+ *               to the shard kv_shard_of() returns, so workers never
+ *               share data and need no locks.
+ */
+
+#ifndef KV_PROTO_H
+#define KV_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KV_MAX_KEY 250
+
+/* Operations. */
+enum kv_op {
+  KV_GET = 1,
+  KV_SET = 2,
+  KV_DEL = 3
+};
+
+/* Response status. */
+enum kv_status {
+  KV_OK = 0,
+  KV_NOT_FOUND = 1,
+  KV_ERROR = 2        /* bad request, value too big or out of memory */
+};
+
+struct kv_req_hdr {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t key_len;
+  uint32_t val_len;
+};
+
+struct kv_resp_hdr {
+  uint8_t status;
+  uint8_t reserved;
+  uint16_t reserved2;
+  uint32_t val_len;
+};
+
+
+/**
+ * Function return 64-bit FNV-1a hash of the key.
+ */
+static inline uint64_t kv_hash(const char *key, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for ( size_t i = 0; i < len; i++ ) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+/**
+ * Function return shard of the key hash. High bits are used, low bits
+ * index the hash table inside the shard.
+ */
+static inline unsigned kv_shard_of(uint64_t hash, unsigned shards) {
+  return (unsigned) ((hash >> 40) % shards);
+}
+
+#endif /* KV_PROTO_H */
@@ -0,0 +1,312 @@
+/* File:         rbuf.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Adaptive read buffer of a TCP connection. Its size
+ *               follows the traffic: every RBUF_WINDOW reads the fill
+ *               ratio of the free space is checked, a connection whose
+ *               reads keep filling the buffer (bulk sender) doubles it,
+ *               one whose reads use less than a quarter of it (small
+ *               requests) shrinks it to twice its largest read.
+ *
+ *               Buffers stay between the per-connection min_cap and
+ *               max_cap. Speculative growth of all connections of the
+ *               process is limited by a global budget; growth needed
+ *               to hold one message which does not fit is always
+ *               granted up to max_cap, the budget then only stops
+ *               further speculative growth.
+ *
+ *               SO_RCVBUF follows the buffer: connections with small
+ *               reads for RBUF_SMALL_WINDOWS windows in a row get
+ *               RBUF_RCVBUF_MULT times their buffer (less kernel memory
+ *               queued for chatty clients). Setting SO_RCVBUF turns
+ *               kernel autotuning off for good: if such a connection
+ *               turns into a bulk sender its SO_RCVBUF follows the
+ *               growing buffer, but only up to net.core.rmem_max,
+ *               usually far below what autotuning would give it.
+ *               Connections whose SO_RCVBUF would already exceed
+ *               rmem_max are not pinned. Other connections keep kernel
+ *               autotuning.
+ *
+ *               Data of the buffer is data[0 .. len), the caller
+ *               consumes it with rbuf_consume().
+ */
+
+#ifndef RBUF_H
+#define RBUF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define RBUF_MIN 512                       /* default smallest buffer */
+#define RBUF_MAX (1 << 20)                 /* default per-connection cap */
+#define RBUF_BUDGET (64 << 20)             /* default budget of all buffers */
+#define RBUF_WINDOW 16                     /* reads of one decision */
+#define RBUF_GROW_FULL 12                  /* full reads of a window to grow */
+#define RBUF_SHRINK_FILL 64                /* average fill (1/256) to shrink */
+#define RBUF_SMALL_WINDOWS 4               /* small windows to set SO_RCVBUF */
+#define RBUF_RCVBUF_MULT 4                 /* SO_RCVBUF per buffer byte */
+#define RBUF_MIN_RCVBUF 16384
+
+/* Read buffer of one connection. */
+struct rbuf {
+  int fd;
+  char *data;
+  size_t len;                              /* unconsumed bytes */
+  size_t cap;
+  size_t min_cap, max_cap;
+  int rcvbuf;                              /* SO_RCVBUF set, 0 = autotuning */
+  unsigned reads;                          /* reads of the window */
+  unsigned full;                           /* of them filled the free space */
+  unsigned fill_sum;                       /* fill ratios in 1/256 */
+  size_t max_read;                         /* largest read of the window */
+  unsigned small_windows;                  /* windows of small reads in a row */
+  uint64_t grows, shrinks, denied;
+};
+
+/* Bytes of all read buffers of the process and their budget. */
+static _Atomic size_t rbuf_used;
+static size_t rbuf_budget = RBUF_BUDGET;
+
+/* net.core.rmem_max, read on first use (0 = not read yet). */
+static _Atomic int rbuf_rmem_max;
+
+
+/**
+ * Function set global budget of the read buffers, before the first
+ * connection.
+ */
+static inline void rbuf_set_budget(size_t bytes) {
+  rbuf_budget = bytes;
+}
+
+
+/**
+ * Function prepare read buffer of the connection with min_cap bytes,
+ * the smallest buffer is granted even over the budget.
+ *
+ * @param min_cap is a smallest buffer (0 = RBUF_MIN)
+ * @param max_cap is a per-connection cap (0 = RBUF_MAX)
+ * @return 0 on success, -1 on error
+ */
+static inline int rbuf_init(struct rbuf *rb, int fd, size_t min_cap, size_t max_cap) {
+  memset(rb, 0, sizeof(*rb));
+  rb->fd = fd;
+  rb->min_cap = min_cap ? min_cap : RBUF_MIN;
+  rb->max_cap = max_cap ? max_cap : RBUF_MAX;
+  if ( rb->max_cap < rb->min_cap ) {
+    rb->max_cap = rb->min_cap;
+  }
+
+  rb->data = malloc(rb->min_cap);
+  if ( rb->data == NULL ) {
+    return -1;
+  }
+  rb->cap = rb->min_cap;
+  atomic_fetch_add(&rbuf_used, rb->cap);
+
+  return 0;
+}
+
+
+/**
+ * Function release buffer, descriptor stays open.
+ */
+static inline void rbuf_free(struct rbuf *rb) {
+  atomic_fetch_sub(&rbuf_used, rb->cap);
+  free(rb->data);
+  rb->data = NULL;
+  rb->cap = rb->len = 0;
+}
+
+
+/**
+ * Function return net.core.rmem_max, the largest SO_RCVBUF the kernel
+ * grants (INT_MAX if it cannot be read).
+ */
+static inline int rbuf_get_rmem_max(void) {
+  int max = atomic_load(&rbuf_rmem_max);
+
+  if ( max == 0 ) {
+    FILE *f = fopen("/proc/sys/net/core/rmem_max", "r");
+    if ( f == NULL || fscanf(f, "%d", &max) != 1 || max <= 0 ) {
+      max = INT_MAX;
+    }
+    if ( f ) {
+      fclose(f);
+    }
+    atomic_store(&rbuf_rmem_max, max);
+  }
+
+  return max;
+}
+
+
+/**
+ * Function set SO_RCVBUF for the buffer size. Once set, kernel
+ * autotuning is off for the connection and later raises stop at
+ * rmem_max, so a connection is pinned only while that covers it.
+ *
+ * @param small is true if reads of the connection stay small, only
+ *        then kernel autotuning is replaced
+ */
+static inline void rbuf_tune_rcvbuf(struct rbuf *rb, bool small) {
+  int want = rb->cap * RBUF_RCVBUF_MULT;
+  int max = rbuf_get_rmem_max();
+
+  if ( rb->rcvbuf == 0 && (!small || want > max) ) {
+    return;
+  }
+  want = want < RBUF_MIN_RCVBUF ? RBUF_MIN_RCVBUF : want;
+  want = want > max ? max : want;
+  if ( want == rb->rcvbuf ) {
+    return;
+  }
+  if ( setsockopt(rb->fd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(want)) == 0 ) {
+    rb->rcvbuf = want;
+  }
+}
+
+
+/**
+ * Function change buffer size, held data is kept.
+ *
+ * @param cap is a new size, clamped to the caps and never below len
+ * @param needed is true if the held message does not fit (budget is
+ *        not checked)
+ * @return 0 on success, -1 if the buffer stays as it is
+ */
+static inline int rbuf_resize(struct rbuf *rb, size_t cap, bool needed) {
+  cap = cap < rb->min_cap ? rb->min_cap : cap;
+  cap = cap > rb->max_cap ? rb->max_cap : cap;
+  cap = cap < rb->len ? rb->len : cap;
+  if ( cap == rb->cap ) {
+    return -1;
+  }
+
+  if ( cap > rb->cap && !needed && atomic_load(&rbuf_used) + (cap - rb->cap) > rbuf_budget ) {
+    rb->denied++;
+    return -1;
+  }
+
+  char *data = realloc(rb->data, cap);
+  if ( data == NULL ) {
+    return -1;
+  }
+  if ( cap > rb->cap ) {
+    atomic_fetch_add(&rbuf_used, cap - rb->cap);
+    rb->grows++;
+  } else {
+    atomic_fetch_sub(&rbuf_used, rb->cap - cap);
+    rb->shrinks++;
+  }
+  rb->data = data;
+  rb->cap = cap;
+  rbuf_tune_rcvbuf(rb, false);
+
+  return 0;
+}
+
+
+/**
+ * Function account one read and resize the buffer at the end of the
+ * window.
+ *
+ * @param n is a number of bytes read
+ * @param space is a free space the read was offered
+ */
+static inline void rbuf_observe(struct rbuf *rb, size_t n, size_t space) {
+  rb->reads++;
+  rb->full += n == space;
+  rb->fill_sum += n * 256 / space;
+  rb->max_read = n > rb->max_read ? n : rb->max_read;
+  if ( rb->reads < RBUF_WINDOW ) {
+    return;
+  }
+
+  if ( rb->full >= RBUF_GROW_FULL ) {
+    rb->small_windows = 0;
+    rbuf_resize(rb, rb->cap * 2, false);
+  } else if ( rb->fill_sum / rb->reads < RBUF_SHRINK_FILL && rb->max_read * 2 < rb->cap ) {
+    /* Next power of two above twice the largest read. */
+    size_t cap = rb->min_cap;
+    while ( cap < rb->max_read * 2 ) {
+      cap *= 2;
+    }
+    rbuf_resize(rb, cap, false);
+    if ( ++rb->small_windows >= RBUF_SMALL_WINDOWS ) {
+      rbuf_tune_rcvbuf(rb, true);
+    }
+  } else {
+    rb->small_windows = 0;
+  }
+
+  rb->reads = rb->full = rb->fill_sum = 0;
+  rb->max_read = 0;
+}
+
+
+/**
+ * Function read into the free space of the buffer. Full buffer grows
+ * first (message larger than the buffer).
+ *
+ * @return as read(), -1 with ENOBUFS if a message does not fit max_cap
+ */
+static inline ssize_t rbuf_read(struct rbuf *rb) {
+  if ( rb->len == rb->cap && rbuf_resize(rb, rb->cap * 2, true) < 0 ) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  size_t space = rb->cap - rb->len;
+  ssize_t n = read(rb->fd, rb->data + rb->len, space);
+  if ( n > 0 ) {
+    rb->len += n;
+    rbuf_observe(rb, n, space);
+  }
+
+  return n;
+}
+
+
+/**
+ * Function make room for a message whose size is known from its header
+ * (one resize instead of growing read by read).
+ *
+ * @return 0 on success, -1 if the message does not fit max_cap
+ */
+static inline int rbuf_reserve(struct rbuf *rb, size_t size) {
+  if ( size <= rb->cap ) {
+    return 0;
+  }
+  if ( size > rb->max_cap ) {
+    return -1;
+  }
+
+  size_t cap = rb->cap;
+  while ( cap < size ) {
+    cap *= 2;
+  }
+  return rbuf_resize(rb, cap, true);
+}
+
+
+/**
+ * Function remove n processed bytes from the front of the buffer.
+ */
+static inline void rbuf_consume(struct rbuf *rb, size_t n) {
+  rb->len -= n;
+  if ( rb->len > 0 ) {
+    memmove(rb->data, rb->data + n, rb->len);
+  }
+}
+
+#endif /* RBUF_H */
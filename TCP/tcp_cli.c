@@ -5,6 +5,8 @@
  */
  
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +16,56 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "kv_proto.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define MAX_SHARDS 64
+#define MAX_THREADS 64
+#define KV_RBUF 65536
+
+
+/* Load test configuration. */
+struct kv_load {
+  struct sockaddr_in addr;      /* address of shard 0 */
+  int shards;
+  int threads;
+  long ops;                     /* operations of all threads */
+  int depth;                    /* requests in flight per connection */
+  int set_pct;                  /* percent of SET requests */
+  int del_pct;                  /* percent of DEL requests */
+  long keys;                    /* key space */
+  size_t val_size;
+};
+
+/* Buffered connection to one shard. */
+struct kv_conn {
+  int fd;
+  char *wbuf;
+  size_t wlen, woff, wcap;
+  char *rbuf;
+  size_t rlen, roff, rcap;
+  long pending;                 /* requests of the batch */
+  long taken;                   /* of them answered */
+  uint8_t *ops;                 /* operations of pending requests */
+};
+
+/* Load test thread. */
+struct kv_thread {
+  struct kv_load *cfg;
+  int id;
+  bool preload;                 /* SET every key of the thread once */
+  long hits, misses, deleted, errors, done;
+  pthread_t thread;
+};
 
 
 /**************************** FUNCTIONS *******************************/
@@ -27,6 +75,35 @@
  */
 void print_info();
 
+
+/**
+ * Function run pipelined key-value load test against tcp_serv -k:
+ * preload the key space, then send the request mix and print ops/s.
+ * 
+ * @param cfg is a load test configuration
+ */
+void kv_load_test(struct kv_load *cfg);
+
+
+/**
+ * Load test thread: keeps depth requests per shard connection in flight
+ * (GETs of one batch form a multi-get). Responses are read while the
+ * batch is written: the server stops reading a connection whose
+ * responses are not taken, so writing the whole batch first deadlocks
+ * with large values.
+ * 
+ * @param arg is a struct kv_thread
+ */
+void *kv_thread_func(void *arg);
+
+
+/**
+ * Function take one complete response from the read buffer.
+ * 
+ * @return status of the response or -1 if it is not complete yet
+ */
+int kv_take_resp(struct kv_conn *c);
+
 /**********************************************************************/
 
 
@@ -37,11 +114,18 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Key-value load test is disabled by default. */
+  bool kv_mode = false;
+  struct kv_load kv = {
+    .shards = 1, .threads = 1, .ops = 1000000, .depth = 32,
+    .set_pct = 10, .del_pct = 5, .keys = 100000, .val_size = 100
+  };
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:kw:T:n:d:r:D:K:s:h")) != -1 ) {
 	/* Case for "client -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -58,6 +142,33 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 'k':
+		kv_mode = true;
+		break;
+	  case 'w':
+		kv.shards = atoi(optarg);
+		break;
+	  case 'T':
+		kv.threads = atoi(optarg);
+		break;
+	  case 'n':
+		kv.ops = atol(optarg);
+		break;
+	  case 'd':
+		kv.depth = atoi(optarg);
+		break;
+	  case 'r':
+		kv.set_pct = atoi(optarg);
+		break;
+	  case 'D':
+		kv.del_pct = atoi(optarg);
+		break;
+	  case 'K':
+		kv.keys = atol(optarg);
+		break;
+	  case 's':
+		kv.val_size = atol(optarg);
+		break;
 	  case ':':
 		printf("Option needs a value.\n");
 		exit(1);
@@ -79,6 +190,19 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  /* Run key-value load test instead of greeting. */
+  if ( kv_mode ) {
+    if ( kv.shards < 1 || kv.shards > MAX_SHARDS || kv.threads < 1 || kv.threads > MAX_THREADS ||
+         kv.depth < 1 || kv.keys < 1 || kv.val_size > (1 << 19) ||
+         kv.set_pct < 0 || kv.del_pct < 0 || kv.set_pct + kv.del_pct > 100 ) {
+      fprintf(stderr, "Wrong load test parameters.\n");
+      exit(1);
+    }
+    kv.addr = cli_addr;
+    kv_load_test(&kv);
+    return 0;
+  }
+
   /* Create client socket. */
   const int cli_socket = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -146,6 +270,238 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port (default port is \"8888\")\n");
+	printf("       -k            key-value cache load test (tcp_serv -k)\n");
+	printf("       -w [count]    server workers (shards), must match tcp_serv -w\n");
+	printf("       -T [count]    client threads (default 1)\n");
+	printf("       -n [count]    number of operations (default 1000000)\n");
+	printf("       -d [count]    pipeline depth per connection (default 32)\n");
+	printf("       -r [percent]  SET requests in the mix (default 10)\n");
+	printf("       -D [percent]  DEL requests in the mix (default 5)\n");
+	printf("       -K [count]    key space (default 100000)\n");
+	printf("       -s [bytes]    value size (default 100)\n");
 	printf("\n");
 	printf("\n");
 }
+
+
+void kv_load_test(struct kv_load *cfg) {
+  static struct kv_thread t[MAX_THREADS];
+  struct timespec start, end;
+
+  /* Preload (not measured), then the measured run. */
+  for ( int phase = 0; phase < 2; phase++ ) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( int i = 0; i < cfg->threads; i++ ) {
+      t[i] = (struct kv_thread) { .cfg = cfg, .id = i, .preload = phase == 0 };
+      if ( pthread_create(&t[i].thread, NULL, kv_thread_func, &t[i]) != 0 ) {
+        fprintf(stderr, "ERROR pthread_create()\n");
+        exit(2);
+      }
+    }
+    for ( int i = 0; i < cfg->threads; i++ ) {
+      pthread_join(t[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+  }
+
+  long done = 0, hits = 0, misses = 0, deleted = 0, errors = 0;
+  for ( int i = 0; i < cfg->threads; i++ ) {
+    done += t[i].done;
+    hits += t[i].hits;
+    misses += t[i].misses;
+    deleted += t[i].deleted;
+    errors += t[i].errors;
+  }
+  double total = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("Operations: %ld, time: %.3f s, %.0f ops/s\n", done, total, done / total);
+  printf("GET hits: %ld, misses: %ld, DEL found: %ld, errors: %ld\n", hits, misses, deleted, errors);
+  printf("\n");
+}
+
+
+/* Append request to the write buffer of the connection. */
+static void kv_append(struct kv_conn *c, int op, const char *key, size_t key_len,
+                      const char *val, size_t val_len) {
+  size_t need = c->wlen + sizeof(struct kv_req_hdr) + key_len + val_len;
+
+  if ( need > c->wcap ) {
+    c->wcap = need * 2;
+    c->wbuf = realloc(c->wbuf, c->wcap);
+    if ( c->wbuf == NULL ) {
+      fprintf(stderr, "ERROR realloc(): %s\n", strerror(errno));
+      exit(7);
+    }
+  }
+
+  struct kv_req_hdr hdr = { .op = op, .key_len = htons(key_len), .val_len = htonl(val_len) };
+  memcpy(c->wbuf + c->wlen, &hdr, sizeof(hdr));
+  memcpy(c->wbuf + c->wlen + sizeof(hdr), key, key_len);
+  memcpy(c->wbuf + c->wlen + sizeof(hdr) + key_len, val, val_len);
+  c->wlen = need;
+  c->ops[c->pending++] = op;
+}
+
+
+void *kv_thread_func(void *arg) {
+  struct kv_thread *t = arg;
+  struct kv_load *cfg = t->cfg;
+  struct kv_conn conns[MAX_SHARDS] = {};
+
+  /* One connection per shard, shard i listens on port + i. */
+  for ( int i = 0; i < cfg->shards; i++ ) {
+    struct sockaddr_in addr = cfg->addr;
+    addr.sin_port = htons(ntohs(cfg->addr.sin_port) + i);
+
+    conns[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( conns[i].fd < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      exit(2);
+    }
+    if ( connect(conns[i].fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ) {
+      fprintf(stderr, "ERROR connect(): %s\n", strerror(errno));
+      exit(3);
+    }
+    fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL) | O_NONBLOCK);
+    conns[i].rcap = KV_RBUF + sizeof(struct kv_resp_hdr) + cfg->val_size;
+    conns[i].rbuf = malloc(conns[i].rcap);
+    conns[i].ops = malloc((size_t) cfg->depth * cfg->shards);
+    if ( conns[i].rbuf == NULL || conns[i].ops == NULL ) {
+      fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+      exit(7);
+    }
+  }
+
+  char *val = malloc(cfg->val_size + 1);
+  memset(val, 'v', cfg->val_size);
+
+  /* Keys of the preload are split between threads. */
+  long first = cfg->keys * t->id / cfg->threads;
+  long last = cfg->keys * (t->id + 1) / cfg->threads;
+  long todo = t->preload ? last - first : cfg->ops / cfg->threads;
+  long next = first;
+  uint64_t rnd = 0x9E3779B97F4A7C15ULL * (t->id + 1);
+
+  while ( t->done < todo ) {
+
+    /* Build one batch: depth requests per connection on average. */
+    long batch = (long) cfg->depth * cfg->shards;
+    if ( batch > todo - t->done ) {
+      batch = todo - t->done;
+    }
+    for ( long i = 0; i < batch; i++ ) {
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 7;
+      rnd ^= rnd << 17;
+
+      char key[32];
+      long k = t->preload ? next++ : (long) (rnd % cfg->keys);
+      int key_len = snprintf(key, sizeof(key), "key:%08ld", k);
+      struct kv_conn *c = &conns[kv_shard_of(kv_hash(key, key_len), cfg->shards)];
+
+      int pct = (rnd >> 32) % 100;
+      if ( t->preload || pct < cfg->set_pct ) {
+        kv_append(c, KV_SET, key, key_len, val, cfg->val_size);
+      } else if ( pct < cfg->set_pct + cfg->del_pct ) {
+        kv_append(c, KV_DEL, key, key_len, NULL, 0);
+      } else {
+        kv_append(c, KV_GET, key, key_len, NULL, 0);
+      }
+    }
+
+    /* Write batches and read responses as the sockets allow. */
+    struct pollfd pfd[MAX_SHARDS];
+    int busy = cfg->shards;
+    while ( busy > 0 ) {
+      busy = 0;
+      for ( int i = 0; i < cfg->shards; i++ ) {
+        struct kv_conn *c = &conns[i];
+        pfd[i].events = (c->woff < c->wlen ? POLLOUT : 0) | (c->taken < c->pending ? POLLIN : 0);
+        pfd[i].fd = pfd[i].events ? c->fd : -1;
+        busy += pfd[i].events != 0;
+      }
+      if ( busy == 0 ) {
+        break;
+      }
+      if ( poll(pfd, cfg->shards, -1) < 0 ) {
+        if ( errno == EINTR ) {
+          continue;
+        }
+        fprintf(stderr, "ERROR poll(): %s\n", strerror(errno));
+        exit(5);
+      }
+
+      for ( int i = 0; i < cfg->shards; i++ ) {
+        struct kv_conn *c = &conns[i];
+
+        if ( pfd[i].revents & POLLOUT ) {
+          ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+          if ( n < 0 && errno != EAGAIN ) {
+            fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+            exit(6);
+          }
+          c->woff += n > 0 ? n : 0;
+        }
+        if ( !(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+          continue;
+        }
+
+        /* Partial response to the front, then read more. */
+        memmove(c->rbuf, c->rbuf + c->roff, c->rlen - c->roff);
+        c->rlen -= c->roff;
+        c->roff = 0;
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+        if ( n == 0 || (n < 0 && errno != EAGAIN) ) {
+          fprintf(stderr, "ERROR read(): %s\n", n == 0 ? "connection closed" : strerror(errno));
+          exit(5);
+        }
+        c->rlen += n > 0 ? n : 0;
+
+        int status;
+        while ( c->taken < c->pending && (status = kv_take_resp(c)) >= 0 ) {
+          int op = c->ops[c->taken++];
+          if ( status == KV_ERROR ) {
+            t->errors++;
+          } else if ( op == KV_GET ) {
+            t->hits += status == KV_OK;
+            t->misses += status == KV_NOT_FOUND;
+          } else if ( op == KV_DEL ) {
+            t->deleted += status == KV_OK;
+          }
+        }
+      }
+    }
+    for ( int i = 0; i < cfg->shards; i++ ) {
+      conns[i].wlen = conns[i].woff = 0;
+      conns[i].pending = conns[i].taken = 0;
+    }
+    t->done += batch;
+  }
+
+  for ( int i = 0; i < cfg->shards; i++ ) {
+    close(conns[i].fd);
+    free(conns[i].rbuf);
+    free(conns[i].wbuf);
+    free(conns[i].ops);
+  }
+  free(val);
+
+  return NULL;
+}
+
+
+int kv_take_resp(struct kv_conn *c) {
+  struct kv_resp_hdr hdr;
+
+  if ( c->rlen - c->roff < sizeof(hdr) ) {
+    return -1;
+  }
+  memcpy(&hdr, c->rbuf + c->roff, sizeof(hdr));
+  size_t need = sizeof(hdr) + ntohl(hdr.val_len);
+  if ( c->rlen - c->roff < need ) {
+    return -1;
+  }
+  c->roff += need;
+
+  return hdr.status;
+}
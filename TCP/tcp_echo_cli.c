@@ -14,10 +14,19 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wcoalesce.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define MAX_INFLIGHT (1024 * 1024)   /* bytes of one pipelined round */
+
+/* Write coalescing of the benchmark, set once in main(). */
+static enum wco_mode wco_mode = WCO_OFF;
+static size_t wco_bytes;
 
 
 /**************************** FUNCTIONS *******************************/
@@ -35,6 +44,33 @@ void print_info();
  */
 void echo_func(int fd);
 
+
+/**
+ * Function measure echo round trip: send rounds of depth pipelined
+ * messages, wait for their echoes and print throughput, latency
+ * percentiles and TCP segments per message.
+ * 
+ * @param fd is a client socket descriptor
+ * @param count is a number of messages
+ * @param size is a size of a single message
+ * @param depth is a number of messages sent before reading echoes
+ */
+void bench_func(int fd, long count, size_t size, int depth);
+
+
+/**
+ * Function read exactly len bytes from the socket.
+ * 
+ * @return 0 on success, -1 on error or end of stream
+ */
+int read_all(int fd, char *buf, size_t len);
+
+
+/**
+ * Function compare two latencies for qsort().
+ */
+int cmp_u64(const void *a, const void *b);
+
 /**********************************************************************/
 
 
@@ -45,11 +81,16 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Benchmark mode is disabled by default. */
+  long bench_count = 0;
+  size_t bench_size = 64;
+  int bench_depth = 1;
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:n:s:d:c:B:h")) != -1 ) {
 	/* Case for "client -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -66,6 +107,25 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 'n':
+		bench_count = atol(optarg);
+		break;
+	  case 's':
+		bench_size = atol(optarg);
+		break;
+	  case 'd':
+		bench_depth = atoi(optarg);
+		break;
+	  case 'c':
+		if ( (c = wco_parse_mode(optarg)) < 0 ) {
+		  fprintf(stderr, "Unknown coalescing mode: %s.\n", optarg);
+		  exit(1);
+		}
+		wco_mode = c;
+		break;
+	  case 'B':
+		wco_bytes = atol(optarg);
+		break;
 	  case ':':
 		printf("Option needs a value.\n");
 		exit(1);
@@ -104,8 +164,19 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  /* Start echo loop. */
-  echo_func(cli_socket);
+  /* Both sides send a whole round before reading, it has to fit in
+   * the socket buffers. */
+  if ( bench_depth < 1 || bench_size == 0 || bench_depth * bench_size > MAX_INFLIGHT ) {
+    fprintf(stderr, "Wrong depth or size (at most %d B in flight).\n", MAX_INFLIGHT);
+    exit(1);
+  }
+
+  /* Start benchmark or echo loop. */
+  if ( bench_count > 0 ) {
+    bench_func(cli_socket, bench_count, bench_size, bench_depth);
+  } else {
+    echo_func(cli_socket);
+  }
   
   /* Close socket. */
   close(cli_socket);
@@ -125,6 +196,11 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port (default port is \"8888\")\n");
+	printf("       -n [count]    benchmark: send count messages and print latency\n");
+	printf("       -s [bytes]    benchmark message size (default 64)\n");
+	printf("       -d [depth]    benchmark messages in flight (pipelining, default 1)\n");
+	printf("       -c [mode]     write coalescing: off, writev, cork, more (default off)\n");
+	printf("       -B [bytes]    coalescing byte budget (default 16384)\n");
 	printf("\n");
 	printf("\n");
 }
@@ -161,3 +237,96 @@ void echo_func(int fd) {
   
   }	
 }
+
+
+void bench_func(int fd, long count, size_t size, int depth) {
+  char *sendbuf = malloc(size);
+  char *recvbuf = malloc(size);
+  uint64_t *lat = malloc(count * sizeof(uint64_t));
+
+  if ( sendbuf == NULL || recvbuf == NULL || lat == NULL ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    exit(7);
+  }
+  memset(sendbuf, 'x', size);
+
+  struct wco w;
+  wco_init(&w, fd, wco_mode, wco_bytes, 0);
+
+  uint64_t segs_out0 = 0, data_out0 = 0, segs_in0 = 0;
+  bool segs = wco_segments(fd, &segs_out0, &data_out0, &segs_in0) == 0;
+
+  struct timespec start, t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for ( long i = 0; i < count; i += depth ) {
+    int round = count - i < depth ? count - i : depth;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* Send the round, then wait for the echoes one by one. */
+    for ( int j = 0; j < round; j++ ) {
+      if ( wco_queue(&w, sendbuf, size) < 0 ) {
+        fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+        exit(6);
+      }
+    }
+    if ( wco_flush(&w, false) < 0 ) {
+      fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+      exit(6);
+    }
+    for ( int j = 0; j < round; j++ ) {
+      if ( read_all(fd, recvbuf, size) < 0 ) {
+        fprintf(stderr, "ERROR read(): %s\n", strerror(errno));
+        exit(5);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      lat[i + j] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+    }
+  }
+
+  double total = (t1.tv_sec - start.tv_sec) + (t1.tv_nsec - start.tv_nsec) / 1e9;
+  double sum = 0;
+  for ( long i = 0; i < count; i++ ) {
+    sum += lat[i];
+  }
+  qsort(lat, count, sizeof(uint64_t), cmp_u64);
+
+  printf("Messages: %ld, size: %zu B, time: %.3f s\n", count, size, total);
+  printf("Throughput: %.0f msg/s, %.3f MB/s\n", count / total, count * size / total / 1e6);
+  printf("Latency [us]: min %.3f avg %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+         lat[0] / 1e3, sum / count / 1e3, lat[count / 2] / 1e3,
+         lat[count * 99 / 100] / 1e3, lat[count * 999 / 1000] / 1e3, lat[count - 1] / 1e3);
+  printf("Send syscalls per message: %.3f\n", (double) w.syscalls / count);
+
+  /* Segments of both directions, as seen by the client. */
+  uint64_t segs_out, data_out, segs_in;
+  if ( segs && wco_segments(fd, &segs_out, &data_out, &segs_in) == 0 ) {
+    printf("Segments per message: out %.3f (data %.3f), in %.3f\n",
+           (double) (segs_out - segs_out0) / count, (double) (data_out - data_out0) / count,
+           (double) (segs_in - segs_in0) / count);
+  }
+  printf("\n");
+
+  free(lat);
+  free(recvbuf);
+  free(sendbuf);
+}
+
+
+int read_all(int fd, char *buf, size_t len) {
+  while ( len > 0 ) {
+    ssize_t n = read(fd, buf, len);
+    if ( n <= 0 ) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
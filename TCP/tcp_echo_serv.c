@@ -6,6 +6,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,10 +18,90 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "../TRACE/trace.h"
+#include "../RESTART/hot_restart.h"
+#include "../LOWLAT/lowlat.h"
+#include "wcoalesce.h"
+#include "rbuf.h"
+#include "../CORO/coro.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define MAX_UPSTREAMS 16
+#define RELAY_WINDOW 65536
+
+
+/* Upstream server of the relay mode. */
+struct upstream {
+  struct sockaddr_in addr;
+  _Atomic int active;        /* number of relayed connections */
+};
+
+/* Upstream selection policy. */
+enum balance {
+  BALANCE_RR,                /* round robin */
+  BALANCE_LC                 /* least connections */
+};
+
+/* One direction of the relayed connection. */
+struct relay_dir {
+  int src, dst;
+  int pipe[2];               /* kernel buffer between src and dst */
+  size_t window;             /* pipe size granted by the kernel */
+  size_t pending;            /* bytes in the pipe */
+  bool eof;                  /* src closed its write side */
+  bool done;                 /* dst write side shut down */
+};
+
+/* Relayed connection. */
+struct relay {
+  int cli, up;
+  struct upstream *u;        /* upstream tried now, counted as active */
+};
+
+/* Echo connection as a stackless coroutine (-e mode). */
+struct echo_coro {
+  struct coro co;
+  struct rbuf in;            /* echo stays here until it is written */
+  size_t off;                /* bytes of it written */
+};
+
+/* Relay configuration, set once in main(). */
+static struct upstream upstreams[MAX_UPSTREAMS];
+static int n_upstreams;
+static enum balance balance = BALANCE_RR;
+static size_t relay_window = RELAY_WINDOW;
+
+/* Low latency configuration, set once in main(). */
+static int busy_poll_us;                 /* 0 = blocking mode */
+
+/* Hot restart state. SIGHUP is blocked in all threads and delivered
+ * only while the main thread waits with wait_mask. */
+static volatile sig_atomic_t restart_requested;   /* set by SIGHUP */
+static sigset_t wait_mask;
+static bool handover;                    /* pass live echo connection */
+static bool draining;                    /* new instance took over */
+
+/* Write coalescing of echo replies, set once in main(). */
+static enum wco_mode wco_mode = WCO_OFF;
+static size_t wco_bytes = WCO_BYTES;
+static unsigned wco_delay_us;
+
+/* Per-connection cap of the adaptive read buffer, 0 = RBUF_MAX. */
+static size_t rbuf_max_cap;
+
+/* Event engine of the coroutine mode, -1 = blocking echo loop. */
+static int coro_engine_kind = -1;
 
 
 /**************************** FUNCTIONS *******************************/
@@ -34,8 +116,129 @@ void print_info();
  * Function send recived data.
  * 
  * @param fd is a client socket descriptor
+ * @return 0 when connection ended, 1 when interrupted by restart request
+ */
+int echo_func(int fd);
+
+
+/**
+ * Function send recived data with coalesced writes: replies to
+ * pipelined requests are queued while more input is waiting (or
+ * arrives within the delay budget) and go out in one writev().
+ * 
+ * @param fd is a client socket descriptor
+ * @return 0 when connection ended, 1 when interrupted by restart request
+ */
+int echo_coalesce(int fd);
+
+
+/**
+ * Echo handler of the coroutine mode.
+ * 
+ * @param c is a struct echo_coro
+ * @return what the coroutine waits for
+ */
+int echo_coro_fn(struct coro *c);
+
+
+/**
+ * Function serve listening socket and the connections from the old
+ * instance with echo coroutines on the event engine. On SIGHUP the
+ * listening socket goes to a new instance, connections are drained.
+ * 
+ * @param serv_socket is a listening socket
+ * @param conn_fds is an array of connections of the old instance
+ * @param n_conn is a number of connections
+ * @param argv is an argument vector of main()
+ */
+void coro_serve(int serv_socket, const int *conn_fds, int n_conn, char **argv);
+
+
+/**
+ * Function serve echo connection until it ends or is handed over
+ * to the new instance.
+ * 
+ * @param fd is a client socket descriptor
+ * @param serv_socket is a listening socket
+ * @param argv is an argument vector of main()
+ */
+void echo_conn(int fd, int serv_socket, char **argv);
+
+
+/**
+ * Function start new instance and pass it the listening socket and
+ * optionally the live echo connection. On success the old instance
+ * closes the listening socket and only drains.
+ * 
+ * @param serv_socket is a listening socket
+ * @param cli is a live connection to hand over or -1
+ * @param argv is an argument vector of main()
+ * @return 0 on success, -1 if old instance has to keep serving
+ */
+int hot_restart(int serv_socket, int cli, char **argv);
+
+
+/**
+ * Function wait until all relayed connections are finished.
+ */
+void relay_drain(void);
+
+
+/**
+ * SIGHUP handler, request hot restart.
+ */
+void restart_handler(int sig);
+
+
+/**
+ * Function parse upstream address in form "ip:port" and add it
+ * to the upstream table.
+ * 
+ * @param spec is an upstream address
+ * @return 0 on success, -1 on error
+ */
+int add_upstream(const char *spec);
+
+
+/**
+ * Function choose upstream according to balance policy and start relay
+ * thread for the client. Connecting is left to the thread, so a slow
+ * upstream does not stall accept().
+ * 
+ * @param cli is a client socket descriptor
+ * @return 0 on success, -1 on error (client socket is closed)
+ */
+int relay_start(int cli);
+
+
+/**
+ * Function connect relay to its upstream, the next ones are tried
+ * when it fails.
+ * 
+ * @param r is a relay with the chosen upstream
+ * @return 0 on success, -1 if no upstream accepted the connection
+ */
+int relay_connect(struct relay *r);
+
+
+/**
+ * Relay thread: connect to the upstream, move data in both directions
+ * with splice() through per-direction pipes, propagate half-close and
+ * stop reading a side whose pipe is full.
+ * 
+ * @param arg is a struct relay
  */
-void echo_func(int fd);
+void *relay_func(void *arg);
+
+
+/**
+ * Function write whole buffer, retried after a signal and spinning
+ * while the buffer of a non-blocking (busy poll) socket is full.
+ * 
+ * @return number of bytes written or -1 on error
+ */
+ssize_t write_all(int fd, const char *buf, size_t len);
+
 
 /**********************************************************************/
 
@@ -47,11 +250,14 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Memory locking is disabled by default. */
+  bool lock = false;
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:u:b:W:P:C:LXc:B:D:e:R:M:h")) != -1 ) {
 	/* Case for "server -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -68,6 +274,76 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 'u':
+		if ( add_upstream(optarg) < 0 ) {
+		  fprintf(stderr, "Wrong upstream: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'b':
+		if ( strcmp(optarg, "rr") == 0 ) {
+		  balance = BALANCE_RR;
+		} else if ( strcmp(optarg, "lc") == 0 ) {
+		  balance = BALANCE_LC;
+		} else {
+		  fprintf(stderr, "Unknown balance policy: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'W':
+		if ( atol(optarg) <= 0 ) {
+		  fprintf(stderr, "Wrong relay window: %s.\n", optarg);
+		  exit(1);
+		}
+		relay_window = atol(optarg);
+		break;
+	  case 'P':
+		busy_poll_us = atoi(optarg);
+		break;
+	  case 'C':
+		if ( parse_cpus(optarg) < 0 ) {
+		  fprintf(stderr, "Wrong CPU list: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'L':
+		lock = true;
+		break;
+	  case 'X':
+		handover = true;
+		break;
+	  case 'c':
+		if ( (c = wco_parse_mode(optarg)) < 0 ) {
+		  fprintf(stderr, "Unknown coalescing mode: %s.\n", optarg);
+		  exit(1);
+		}
+		wco_mode = c;
+		break;
+	  case 'B':
+		wco_bytes = atol(optarg);
+		if ( wco_bytes < MAX_MSG_LEN ) {
+		  wco_bytes = MAX_MSG_LEN;
+		}
+		break;
+	  case 'D':
+		wco_delay_us = atoi(optarg);
+		break;
+	  case 'e':
+		if ( strcmp(optarg, "poll") == 0 ) {
+		  coro_engine_kind = CORO_POLL;
+		} else if ( strcmp(optarg, "epoll") == 0 ) {
+		  coro_engine_kind = CORO_EPOLL;
+		} else {
+		  fprintf(stderr, "Unknown event engine: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'R':
+		rbuf_max_cap = (size_t) atol(optarg) << 10;
+		break;
+	  case 'M':
+		rbuf_set_budget((size_t) atol(optarg) << 20);
+		break;
 	  case ':':
 		printf("Option needs a value\n");
 		exit(1);
@@ -89,46 +365,126 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  const int serv_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if ( serv_socket < 0 ) {
-    fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
-    exit(2);
+  /* Coroutine connections are drained on restart, not handed over. */
+  if ( coro_engine_kind >= 0 && (n_upstreams > 0 || wco_mode != WCO_OFF || busy_poll_us || handover) ) {
+    fprintf(stderr, "Event engine (-e) serves echo only, without -u, -c, -P and -X.\n");
+    exit(1);
   }
 
-  socklen_t len = sizeof(serv_addr);
-
-  if ( bind(serv_socket, (struct sockaddr*) &serv_addr, len) < 0 ) {
-    fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
-    exit(3);
+  /* Sockets of the old instance after hot restart. */
+  int listen_fds[HOT_RESTART_MAX_FDS], conn_fds[HOT_RESTART_MAX_FDS];
+  int n_listen, n_conn;
+  const int restarted = hot_restart_recv(listen_fds, &n_listen, conn_fds, &n_conn, HOT_RESTART_MAX_FDS);
+  if ( restarted < 0 || (restarted && n_listen != 1) ) {
+    exit(5);
   }
 
-  /* Start listening on the socket. */
-  if ( listen(serv_socket, 10) ) {
-    fprintf(stderr, "ERROR listen(): %s\n", strerror(errno));
-    exit(4);
+  int serv_socket;
+
+  if ( restarted ) {
+    serv_socket = listen_fds[0];
+    printf("Took over listening socket and %d connection(s).\n", n_conn);
+  } else {
+    serv_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( serv_socket < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      exit(2);
+    }
+
+    socklen_t len = sizeof(serv_addr);
+
+    if ( bind(serv_socket, (struct sockaddr*) &serv_addr, len) < 0 ) {
+      fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+      exit(3);
+    }
+
+    /* Start listening on the socket. */
+    if ( listen(serv_socket, 10) ) {
+      fprintf(stderr, "ERROR listen(): %s\n", strerror(errno));
+      exit(4);
+    }
   }
 
+  /* SIGHUP stays blocked and interrupts only the waits with wait_mask
+   * (accept, read, event engine); threads inherit the blocked mask. */
+  struct sigaction sa = { .sa_handler = restart_handler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGHUP, &sa, NULL);
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup, &wait_mask);
+  sigdelset(&wait_mask, SIGHUP);
+
+  if ( n_upstreams > 0 ) {
+    /* Closed peer is reported by splice(), not by the signal. */
+    signal(SIGPIPE, SIG_IGN);
+    printf("Relaying to %d upstream(s)...\n", n_upstreams);
+  }
+  /* Main thread takes the first CPU, relay threads the next ones. */
+  pin_thread();
+  if ( lock ) {
+    lock_memory();
+  }
   printf("Waiting for connection... \n");
 
+  /* Old instance drains from now on, serve its connections first. */
+  hot_restart_ready();
+  if ( coro_engine_kind >= 0 ) {
+    coro_serve(serv_socket, conn_fds, n_conn, argv);
+  }
+  for ( int i = 0; i < n_conn; i++ ) {
+    if ( busy_poll_us ) {
+      busy_poll_setup(conn_fds[i], busy_poll_us);
+    }
+    echo_conn(conn_fds[i], serv_socket, argv);
+  }
+
   while( 1 ) {  
 
+    if ( restart_requested ) {
+      hot_restart(serv_socket, -1, argv);
+    }
+    if ( draining ) {
+      relay_drain();
+      printf("Old instance drained, exiting.\n");
+      exit(0);
+    }
+
     /* Address structure for the client socket. */
     struct sockaddr_in cli_addr = {};
     socklen_t lenc = sizeof(cli_addr);
 
     /* Get connection. */
+    if ( hot_restart_wait_fd(serv_socket, POLLIN, &wait_mask) < 0 ) {
+      if ( errno != EINTR ) {
+        fprintf(stderr, "ERROR ppoll(): %s\n", strerror(errno));
+      }
+      continue;
+    }
     const int cli_socket = accept(serv_socket, (struct sockaddr*) &cli_addr, &lenc);
     if ( cli_socket < 0 ) {
-      fprintf(stderr, "ERROR accept(): %s\n", strerror(errno));
+      if ( errno != EINTR ) {
+        fprintf(stderr, "ERROR accept(): %s\n", strerror(errno));
+      }
 	  continue;
     }
     
-    printf("Connection accepted.\n");
+    /* Relay mode, connection is handled by its own thread. Its
+     * TRACE_ACCEPT is emitted there, next to TRACE_CLOSE. */
+    if ( n_upstreams > 0 ) {
+      relay_start(cli_socket);
+      continue;
+    }
+
+    TRACE_POINT(TRACE_ACCEPT, cli_socket);
+
+    if ( busy_poll_us ) {
+      busy_poll_setup(cli_socket, busy_poll_us);
+    }
 
     /* Start echo loop. */
-    echo_func(cli_socket);
-    
-    close(cli_socket);
+    echo_conn(cli_socket, serv_socket, argv);
   }
 
   return 0;
@@ -146,27 +502,580 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port to listen (default port is \"8888\")\n");
+	printf("       -u [ip:port]  relay clients to upstream instead of echo (repeatable)\n");
+	printf("       -b [rr|lc]    upstream balance: round robin or least connections\n");
+	printf("       -W [bytes]    relay window per direction (default 65536)\n");
+	printf("       -P [usec]     busy poll sockets instead of blocking (SO_BUSY_POLL)\n");
+	printf("       -C [cpu,...]  pin main and relay threads to the CPUs\n");
+	printf("       -L            lock memory (mlockall) and prefault buffers\n");
+	printf("       -X            on restart hand over live echo connection too\n");
+	printf("       -c [mode]     coalesce echo writes: off, writev, cork, more\n");
+	printf("       -B [bytes]    coalescing byte budget (default 16384)\n");
+	printf("       -D [usec]     coalescing delay budget (default 0, flush when idle)\n");
+	printf("       -e [engine]   serve all connections at once with echo coroutines\n");
+	printf("                     on event engine: poll or epoll (not with -u, -c,\n");
+	printf("                     -P, -X; connections are drained on restart)\n");
+	printf("       -R [KiB]      read buffer cap of a connection (default 1024)\n");
+	printf("       -M [MiB]      read buffers of all connections (default 64)\n");
+	printf("\n");
+	printf("Signals:\n");
+	printf("       SIGHUP        hot restart: start new instance of the binary,\n");
+	printf("                     pass it the sockets, drain and exit\n");
 	printf("\n");
 	printf("\n");
 }
 
 
-void echo_func(int fd) {
+int echo_func(int fd) {
 	
-  /* Data buffer. */
-  char buffer[MAX_MSG_LEN];
+  /* Data buffer, sized by the traffic of the connection. */
+  struct rbuf rb;
   
   /* Number of characters recived. */
-  int n;
+  int n = 0;
+  int ret = 0;
+
+  if ( rbuf_init(&rb, fd, 0, rbuf_max_cap) < 0 ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    return 0;
+  }
     
   /* Send recived data. */
-  while ( (n = read(fd, buffer, sizeof(buffer))) > 0 ) {
-    if ( write(fd, buffer, sizeof(buffer)) <= 0 ) {
+  while ( 1 ) {
+    /* Everything read was echoed, connection can move to the new instance. */
+    if ( restart_requested ) {
+      ret = 1;
+      break;
+    }
+    TRACE_POINT(TRACE_READ_BEGIN, fd);
+    if ( busy_poll_us ) {
+      do {
+        n = rbuf_read(&rb);
+      } while ( n < 0 && errno == EAGAIN && !restart_requested );
+    } else {
+      n = hot_restart_wait_fd(fd, POLLIN, &wait_mask) < 0 ? -1 : rbuf_read(&rb);
+    }
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( n < 0 && (errno == EINTR || errno == EAGAIN) ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      break;
+    }
+    
+    /* All of it is echoed before the next check of restart_requested. */
+    TRACE_POINT(TRACE_WRITE_BEGIN, fd);
+    ssize_t w = write_all(fd, rb.data, rb.len);
+    TRACE_POINT(TRACE_WRITE_END, w);
+    if ( w < 0 ) {
       fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+      break;
     }
+    rbuf_consume(&rb, rb.len);
   }
-  if (n < 0) {
+  if ( n < 0 && !ret ) {
 	fprintf(stderr, "ERROR read(): %s\n", strerror(errno));
   }
+  rbuf_free(&rb);
+
+  return ret;
+}
+
+
+int echo_coalesce(int fd) {
+  char *buffer = malloc(wco_bytes);
+  size_t used = 0;
+  ssize_t n = 0;
+  int ret = 0;
+  bool write_failed = false;
+
+  if ( buffer == NULL ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    return 0;
+  }
+
+  struct wco w;
+  wco_init(&w, fd, wco_mode, wco_bytes, wco_delay_us);
+
+  while ( 1 ) {
+    if ( restart_requested ) {
+      ret = 1;
+      break;
+    }
+    TRACE_POINT(TRACE_READ_BEGIN, fd);
+    if ( busy_poll_us ) {
+      n = read(fd, buffer + used, wco_bytes - used);
+    } else {
+      n = hot_restart_wait_fd(fd, POLLIN, &wait_mask) < 0 ? -1 : read(fd, buffer + used, wco_bytes - used);
+    }
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n == 0 || (n < 0 && errno != EAGAIN) ) {
+      break;
+    }
+
+    if ( n > 0 ) {
+      /* Budget reached: queue was flushed, buffer can be reused. A
+       * failed flush leaves the iovecs pointing into the buffer. */
+      if ( wco_queue(&w, buffer + used, n) < 0 ) {
+        fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+        write_failed = true;
+        break;
+      }
+      used = w.niov ? used + n : 0;
+
+      /* More pipelined input is already waiting. */
+      int avail = 0;
+      if ( ioctl(fd, FIONREAD, &avail) == 0 && avail > 0 && used < wco_bytes ) {
+        continue;
+      }
+    }
+
+    /* Input is idle: wait for more up to the delay budget, then flush. */
+    uint64_t wait = wco_wait_ns(&w);
+    if ( wait > 0 ) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      struct timespec ts = { wait / 1000000000ULL, wait % 1000000000ULL };
+      if ( ppoll(&pfd, 1, &ts, busy_poll_us ? NULL : &wait_mask) > 0 ) {
+        continue;
+      }
+    }
+    if ( w.niov > 0 ) {
+      TRACE_POINT(TRACE_WRITE_BEGIN, fd);
+      int r = wco_flush(&w, false);
+      TRACE_POINT(TRACE_WRITE_END, r);
+      if ( r < 0 ) {
+        fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+        write_failed = true;
+        break;
+      }
+    }
+    used = 0;
+  }
+  if ( n < 0 && errno != EINTR && errno != EAGAIN ) {
+    fprintf(stderr, "ERROR read(): %s\n", strerror(errno));
+  }
+
+  /* Whatever was read is echoed before close or handover. */
+  if ( !write_failed && wco_flush(&w, false) < 0 ) {
+    fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+  }
+  free(buffer);
+
+  return ret;
+}
+
+
+int echo_coro_fn(struct coro *c) {
+  struct echo_coro *s = (struct echo_coro *) c;
+
+  CORO_BEGIN(c);
+  TRACE_POINT(TRACE_ACCEPT, c->fd);
+  if ( rbuf_init(&s->in, c->fd, 0, rbuf_max_cap) < 0 ) {
+    return CORO_DONE;
+  }
+  while ( 1 ) {
+    CORO_AWAIT(c, CORO_READ, rbuf_read(&s->in));
+    if ( c->ret <= 0 ) {
+      break;
+    }
+
+    /* Usually written at once, otherwise resumed when writable. */
+    s->off = 0;
+    while ( s->off < s->in.len ) {
+      CORO_AWAIT(c, CORO_WRITE, write(c->fd, s->in.data + s->off, s->in.len - s->off));
+      if ( c->ret <= 0 ) {
+        break;
+      }
+      s->off += c->ret;
+    }
+    if ( s->off < s->in.len ) {
+      break;
+    }
+    rbuf_consume(&s->in, s->in.len);
+  }
+  rbuf_free(&s->in);
+  TRACE_POINT(TRACE_CLOSE, c->fd);
+  CORO_END(c);
+}
+
+
+void coro_serve(int serv_socket, const int *conn_fds, int n_conn, char **argv) {
+  struct coro_engine e;
+
+  /* One reset peer must not kill the connections of all others. */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ( coro_engine_init(&e, coro_engine_kind, coro_fd_limit()) < 0 ) {
+    fprintf(stderr, "ERROR coro_engine_init(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  struct coro_acceptor *a = calloc(1, sizeof(*a));
+  if ( a == NULL ) {
+    fprintf(stderr, "ERROR calloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+  e.sigmask = &wait_mask;
+  fcntl(serv_socket, F_SETFL, fcntl(serv_socket, F_GETFL) | O_NONBLOCK);
+  a->co.fn = coro_accept_fn;
+  a->co.fd = serv_socket;
+  a->e = &e;
+  a->handler = echo_coro_fn;
+  a->size = sizeof(struct echo_coro);
+  coro_spawn(&e, &a->co);
+
+  for ( int i = 0; i < n_conn; i++ ) {
+    struct echo_coro *s = calloc(1, sizeof(*s));
+    if ( s == NULL ) {
+      close(conn_fds[i]);
+      continue;
+    }
+    fcntl(conn_fds[i], F_SETFL, fcntl(conn_fds[i], F_GETFL) | O_NONBLOCK);
+    s->co.fn = echo_coro_fn;
+    s->co.fd = conn_fds[i];
+    coro_spawn(&e, &s->co);
+  }
+
+  while ( 1 ) {
+    coro_engine_run(&e, &restart_requested);
+    if ( draining && e.n == 0 ) {
+      printf("Old instance drained, exiting.\n");
+      exit(0);
+    }
+    if ( !restart_requested || draining ) {
+      restart_requested = 0;
+      continue;
+    }
+
+    /* Listening socket leaves the engine before it is passed on. */
+    coro_remove(&e, &a->co);
+    if ( hot_restart(serv_socket, -1, argv) < 0 ) {
+      coro_watch(&e, &a->co, CORO_READ);
+      continue;
+    }
+    free(a);
+  }
+}
+
+
+void echo_conn(int fd, int serv_socket, char **argv) {
+  sigset_t blocked;
+
+  while ( 1 ) {
+    /* Busy polling never blocks, it takes SIGHUP at any time. */
+    if ( busy_poll_us ) {
+      pthread_sigmask(SIG_SETMASK, &wait_mask, &blocked);
+    }
+    int interrupted = wco_mode != WCO_OFF ? echo_coalesce(fd) : echo_func(fd);
+    if ( busy_poll_us ) {
+      pthread_sigmask(SIG_SETMASK, &blocked, NULL);
+    }
+    if ( !interrupted ) {
+      break;
+    }
+    if ( draining ) {
+      /* Further SIGHUPs while draining are ignored. */
+      restart_requested = 0;
+      continue;
+    }
+    if ( hot_restart(serv_socket, handover ? fd : -1, argv) == 0 && handover ) {
+      close(fd);
+      return;
+    }
+  }
+
+  close(fd);
+  TRACE_POINT(TRACE_CLOSE, fd);
+}
+
+
+int hot_restart(int serv_socket, int cli, char **argv) {
+  restart_requested = 0;
+  printf("Hot restart...\n");
+
+  if ( hot_restart_spawn(argv) < 0 ) {
+    return -1;
+  }
+  if ( hot_restart_send(&serv_socket, 1, &cli, cli >= 0) < 0 || hot_restart_wait_ready() < 0 ) {
+    fprintf(stderr, "ERROR: new instance failed, still serving.\n");
+    return -1;
+  }
+
+  /* Pending connections stay in the queue for the new instance. */
+  close(serv_socket);
+  draining = true;
+
+  return 0;
+}
+
+
+void relay_drain(void) {
+  while ( 1 ) {
+    int active = 0;
+    for ( int i = 0; i < n_upstreams; i++ ) {
+      active += atomic_load(&upstreams[i].active);
+    }
+    if ( active == 0 ) {
+      return;
+    }
+    usleep(100000);
+  }
+}
+
+
+void restart_handler(int sig) {
+  (void) sig;
+  restart_requested = 1;
+}
+
+
+int add_upstream(const char *spec) {
+  if ( n_upstreams == MAX_UPSTREAMS ) {
+    return -1;
+  }
+
+  char ip[INET_ADDRSTRLEN];
+  const char *colon = strrchr(spec, ':');
+  if ( colon == NULL || (size_t) (colon - spec) >= sizeof(ip) ) {
+    return -1;
+  }
+  memcpy(ip, spec, colon - spec);
+  ip[colon - spec] = '\0';
+
+  struct upstream *u = &upstreams[n_upstreams];
+  u->addr.sin_family = AF_INET;
+  u->addr.sin_port = htons(atoi(colon + 1));
+  if ( inet_pton(AF_INET, ip, &u->addr.sin_addr) <= 0 ) {
+    return -1;
+  }
+  n_upstreams++;
+
+  return 0;
 }
 
+
+int relay_start(int cli) {
+  static unsigned next;
+
+  int first = next++ % n_upstreams;
+  if ( balance == BALANCE_LC ) {
+    for ( int i = 0; i < n_upstreams; i++ ) {
+      if ( atomic_load(&upstreams[i].active) < atomic_load(&upstreams[first].active) ) {
+        first = i;
+      }
+    }
+  }
+
+  struct relay *r = malloc(sizeof(*r));
+  if ( r == NULL ) {
+    TRACE_POINT(TRACE_ACCEPT, cli);
+    close(cli);
+    TRACE_POINT(TRACE_CLOSE, cli);
+    return -1;
+  }
+  r->cli = cli;
+  r->up = -1;
+  r->u = &upstreams[first];
+  atomic_fetch_add(&r->u->active, 1);
+
+  /* Relay threads inherit blocked SIGHUP, the main thread takes it. */
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, relay_func, r);
+  if ( err != 0 ) {
+    fprintf(stderr, "ERROR pthread_create()\n");
+    atomic_fetch_sub(&r->u->active, 1);
+    free(r);
+    TRACE_POINT(TRACE_ACCEPT, cli);
+    close(cli);
+    TRACE_POINT(TRACE_CLOSE, cli);
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+
+int relay_connect(struct relay *r) {
+  int first = r->u - upstreams;
+
+  /* Try every upstream at most once, starting from the chosen one. */
+  for ( int i = 0; i < n_upstreams; i++ ) {
+    struct upstream *u = &upstreams[(first + i) % n_upstreams];
+    if ( u != r->u ) {
+      atomic_fetch_sub(&r->u->active, 1);
+      atomic_fetch_add(&u->active, 1);
+      r->u = u;
+    }
+
+    int up = socket(AF_INET, SOCK_STREAM, 0);
+    if ( up < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      return -1;
+    }
+    if ( connect(up, (struct sockaddr*) &u->addr, sizeof(u->addr)) < 0 ) {
+      fprintf(stderr, "ERROR connect(): %s\n", strerror(errno));
+      close(up);
+      continue;
+    }
+    r->up = up;
+    return 0;
+  }
+
+  return -1;
+}
+
+
+void *relay_func(void *arg) {
+  struct relay *r = arg;
+
+  TRACE_POINT(TRACE_ACCEPT, r->cli);
+  pin_thread();
+
+  /* Upstream is connected here, off the accept thread. */
+  bool failed = relay_connect(r) < 0;
+
+  /* Client -> upstream and upstream -> client. */
+  struct relay_dir dirs[2] = {
+    { .src = r->cli, .dst = r->up, .pipe = { -1, -1 } },
+    { .src = r->up, .dst = r->cli, .pipe = { -1, -1 } }
+  };
+
+  if ( !failed ) {
+    fcntl(r->cli, F_SETFL, fcntl(r->cli, F_GETFL) | O_NONBLOCK);
+    fcntl(r->up, F_SETFL, fcntl(r->up, F_GETFL) | O_NONBLOCK);
+    if ( busy_poll_us ) {
+      busy_poll_setup(r->cli, busy_poll_us);
+      busy_poll_setup(r->up, busy_poll_us);
+    }
+  }
+
+  for ( int d = 0; d < 2 && !failed; d++ ) {
+    if ( pipe2(dirs[d].pipe, O_NONBLOCK) < 0 ) {
+      fprintf(stderr, "ERROR pipe(): %s\n", strerror(errno));
+      failed = true;
+      break;
+    }
+    /* Pipe size is the window of the direction. Kernel rounds it up, or
+     * refuses it above fs.pipe-max-size, so take the size it granted. */
+    int size = fcntl(dirs[d].pipe[1], F_SETPIPE_SZ, (int) relay_window);
+    if ( size < 0 ) {
+      static _Atomic int warned;
+      if ( !atomic_exchange(&warned, 1) ) {
+        fprintf(stderr, "ERROR fcntl(F_SETPIPE_SZ): %s, using default pipe size\n", strerror(errno));
+      }
+      size = fcntl(dirs[d].pipe[1], F_GETPIPE_SZ);
+    }
+    if ( size <= 0 ) {
+      failed = true;
+      break;
+    }
+    dirs[d].window = size;
+  }
+
+  while ( !failed && !(dirs[0].done && dirs[1].done) ) {
+    struct pollfd pfd[2] = {
+      { .fd = r->cli },
+      { .fd = r->up }
+    };
+
+    /* Read only while the pipe has room, write only when it has data. */
+    for ( int d = 0; d < 2; d++ ) {
+      if ( !dirs[d].eof && dirs[d].pending < dirs[d].window ) {
+        pfd[d].events |= POLLIN;
+      }
+      if ( dirs[d].pending > 0 ) {
+        pfd[1 - d].events |= POLLOUT;
+      }
+    }
+
+    /* Busy poll mode spins instead of sleeping in poll(). */
+    if ( poll(pfd, 2, busy_poll_us ? 0 : -1) < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      fprintf(stderr, "ERROR poll(): %s\n", strerror(errno));
+      break;
+    }
+
+    /* Error or hangup is reported even for no requested events. Side
+     * with nothing to read or write would report it on every poll(). */
+    for ( int d = 0; d < 2; d++ ) {
+      if ( (pfd[d].revents & (POLLERR | POLLHUP | POLLNVAL)) && !(pfd[d].events & (POLLIN | POLLOUT)) ) {
+        failed = true;
+      }
+    }
+
+    for ( int d = 0; d < 2 && !failed; d++ ) {
+      struct relay_dir *dir = &dirs[d];
+      ssize_t n;
+
+      /* Socket -> pipe. */
+      if ( (pfd[d].events & POLLIN) && (pfd[d].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+        n = splice(dir->src, NULL, dir->pipe[1], NULL, dir->window - dir->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if ( n > 0 ) {
+          dir->pending += n;
+        } else if ( n == 0 ) {
+          dir->eof = true;
+        } else if ( errno != EAGAIN ) {
+          failed = true;
+        }
+      }
+
+      /* Pipe -> socket. */
+      if ( dir->pending > 0 && (pfd[1 - d].revents & (POLLOUT | POLLERR | POLLHUP)) ) {
+        n = splice(dir->pipe[0], NULL, dir->dst, NULL, dir->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if ( n > 0 ) {
+          dir->pending -= n;
+        } else if ( n < 0 && errno != EAGAIN ) {
+          failed = true;
+        }
+      }
+
+      /* Propagate half-close once everything was forwarded. */
+      if ( dir->eof && dir->pending == 0 && !dir->done ) {
+        shutdown(dir->dst, SHUT_WR);
+        dir->done = true;
+      }
+    }
+  }
+
+  for ( int d = 0; d < 2; d++ ) {
+    if ( dirs[d].pipe[0] >= 0 ) {
+      close(dirs[d].pipe[0]);
+      close(dirs[d].pipe[1]);
+    }
+  }
+  if ( r->up >= 0 ) {
+    close(r->up);
+  }
+  close(r->cli);
+  TRACE_POINT(TRACE_CLOSE, r->cli);
+  atomic_fetch_sub(&r->u->active, 1);
+  free(r);
+
+  return NULL;
+}
+
+
+ssize_t write_all(int fd, const char *buf, size_t len) {
+  size_t done = 0;
+
+  while ( done < len ) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if ( n < 0 && (errno == EAGAIN || errno == EINTR) ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      return -1;
+    }
+    done += n;
+  }
+
+  return done;
+}
@@ -5,6 +5,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +16,102 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "../TRACE/trace.h"
+#include "kv_proto.h"
+#include "rbuf.h"
+#include "../CORO/coro.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define MAX_WORKERS 64
+
+#define KV_WAYS 8                     /* slots per bucket (one cache line) */
+#define KV_PROBE 2                    /* buckets scanned per lookup */
+#define KV_MIN_SHIFT 6
+#define KV_MIN_CHUNK (1 << KV_MIN_SHIFT)
+#define KV_PAGE_SHIFT 20
+#define KV_PAGE (1 << KV_PAGE_SHIFT)  /* slab page, 1 MiB */
+#define KV_CLASSES (KV_PAGE_SHIFT - KV_MIN_SHIFT + 1)
+#define KV_ITEM_USED 1
+#define KV_ITEM_REF 2                 /* CLOCK reference bit */
+#define KV_REBALANCE 64               /* evictions per page move */
+#define KV_MAX_REQ (sizeof(struct kv_req_hdr) + KV_MAX_KEY + KV_PAGE)
+#define KV_WBUF 16384
+#define KV_WBUF_HIGH (256 * 1024)     /* unsent responses to stop reading */
+#define KV_READ_BATCH 16              /* reads of a connection per wakeup */
+#define KV_EVENTS 64
+
+
+/* Hash table bucket: tags (hash bits, 0 = empty) and item indexes.
+ * Item of tags[i] is KV_WAYS words further, in items[i]. */
+struct kv_bucket {
+  _Alignas(64) uint32_t tags[KV_WAYS];
+  uint32_t items[KV_WAYS];
+};
+
+/* Item stored in a slab chunk, key and value follow the header. */
+struct kv_item {
+  uint64_t hash;
+  uint32_t val_len;
+  uint16_t key_len;
+  uint8_t cls;
+  uint8_t flags;
+  uint32_t next_free;                 /* free list link (index + 1) */
+  uint32_t reserved;
+  char data[];
+};
+
+/* Chunks of one size, taken from whole pages of the arena. */
+struct kv_class {
+  uint32_t *pages;                    /* pages owned by the class */
+  uint32_t n_pages;
+  uint32_t free;                      /* free list head (index + 1) */
+  uint32_t hand_page, hand_chunk;     /* CLOCK hand */
+  uint32_t evictions;                 /* for page rebalancing */
+};
+
+/* Cache shard, owned by exactly one worker thread. */
+struct kv_shard {
+  struct kv_bucket *table;
+  uint32_t mask;                      /* number of buckets - 1 */
+  char *arena;                        /* memory cap of the shard */
+  uint32_t n_pages, used_pages;
+  struct kv_class classes[KV_CLASSES];
+  uint64_t evictions;
+};
+
+/* Client connection of a worker. */
+struct kv_conn {
+  int fd;
+  bool want_out;                      /* EPOLLOUT registered */
+  bool stop_in;                       /* EPOLLIN dropped, see KV_WBUF_HIGH */
+  struct rbuf in;                     /* adaptive, up to one request */
+  char *wbuf;
+  size_t wlen, woff, wcap;
+};
+
+/* Worker thread with its own listening socket and shard. */
+struct kv_worker {
+  int id;
+  int listen_fd;
+  struct kv_shard shard;
+  pthread_t thread;
+};
+
+/* Greeting connection as a stackless coroutine (-e mode). */
+struct hello_coro {
+  struct coro co;
+  uint32_t off;                 /* bytes of the greeting sent */
+};
 
 
 /**************************** FUNCTIONS *******************************/
@@ -27,6 +121,94 @@
  */
 void print_info();
 
+
+/**
+ * Function start key-value cache workers, worker i listens on
+ * port + i and owns shard i. Never returns.
+ * 
+ * @param addr is a server address structure
+ * @param workers is a number of workers (shards)
+ * @param mem_mb is a memory cap of all shards in MiB
+ */
+void kv_serve(struct sockaddr_in *addr, int workers, size_t mem_mb);
+
+
+/**
+ * Function greet all clients at once with coroutines on the event
+ * engine. Never returns.
+ * 
+ * @param serv_socket is a listening socket
+ * @param kind is CORO_POLL or CORO_EPOLL
+ */
+void hello_serve(int serv_socket, enum coro_engine_kind kind);
+
+
+/**
+ * Greeting handler of the coroutine mode: read request, send greeting.
+ * 
+ * @param c is a struct hello_coro
+ * @return what the coroutine waits for
+ */
+int hello_coro_fn(struct coro *c);
+
+
+/**
+ * Function allocate hash table and arena of the shard.
+ * 
+ * @return 0 on success, -1 on error
+ */
+int kv_shard_init(struct kv_shard *s, size_t mem);
+
+
+/**
+ * Function find item with the key.
+ * 
+ * @return pointer to the tag of the slot or NULL if not found
+ */
+uint32_t *kv_find(struct kv_shard *s, uint64_t hash, const char *key, size_t key_len);
+
+
+/**
+ * Function allocate item of the given size. When the class has no free
+ * chunk and no page is left, CLOCK evicts an item of the same class.
+ * 
+ * @return item or NULL if item is too big or there is no memory
+ */
+struct kv_item *kv_alloc(struct kv_shard *s, size_t size);
+
+
+/**
+ * Function return item to the free list of its class.
+ */
+void kv_free(struct kv_shard *s, struct kv_item *it);
+
+
+/**
+ * Function store value, replacing the old one.
+ * 
+ * @return KV_OK or KV_ERROR
+ */
+int kv_set(struct kv_shard *s, uint64_t hash, const char *key, size_t key_len,
+           const char *val, size_t val_len);
+
+
+/**
+ * Function handle complete requests in the read buffer and append
+ * responses to the write buffer. Stops at KV_WBUF_HIGH unsent bytes,
+ * the rest of the requests stays in the read buffer.
+ * 
+ * @return 0 on success, -1 on protocol error
+ */
+int kv_process(struct kv_shard *s, struct kv_conn *c);
+
+
+/**
+ * Worker thread: epoll loop over the listening socket and connections.
+ * 
+ * @param arg is a struct kv_worker
+ */
+void *kv_worker_func(void *arg);
+
 /**********************************************************************/
 
 
@@ -37,11 +219,19 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Key-value cache mode is disabled by default. */
+  bool kv_mode = false;
+  int workers = 1;
+  size_t mem_mb = 64;
+
+  /* Event engine of the coroutine mode, -1 = one client at a time. */
+  int engine = -1;
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:kw:m:M:e:h")) != -1 ) {
 	/* Case for "server -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -58,6 +248,32 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 'k':
+		kv_mode = true;
+		break;
+	  case 'w':
+		workers = atoi(optarg);
+		if ( workers < 1 || workers > MAX_WORKERS ) {
+		  fprintf(stderr, "Wrong number of workers: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'm':
+		mem_mb = atol(optarg);
+		break;
+	  case 'M':
+		rbuf_set_budget((size_t) atol(optarg) << 20);
+		break;
+	  case 'e':
+		if ( strcmp(optarg, "poll") == 0 ) {
+		  engine = CORO_POLL;
+		} else if ( strcmp(optarg, "epoll") == 0 ) {
+		  engine = CORO_EPOLL;
+		} else {
+		  fprintf(stderr, "Unknown event engine: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
 	  case ':':
 		printf("Option needs a value\n");
 		exit(1);
@@ -79,6 +295,11 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  /* Serve key-value requests instead of greetings. */
+  if ( kv_mode ) {
+    kv_serve(&serv_addr, workers, mem_mb);
+  }
+
   /* Create server socket. */
   const int serv_socket = socket(AF_INET, SOCK_STREAM, 0);
   if ( serv_socket < 0 ) {
@@ -101,6 +322,10 @@ int main(int argc, char **argv) {
     exit(4);
   }
 
+  if ( engine >= 0 ) {
+    hello_serve(serv_socket, engine);
+  }
+
   /* Data buffer. */
   char buffer[MAX_MSG_LEN];
   
@@ -108,10 +333,10 @@ int main(int argc, char **argv) {
   int n;
     
 
+  printf("Waiting for connection...\n");
+
   /* Wait for connection. */
   while( 1 ) {
-	  
-    printf("Waiting for connection...\n");
 
     /* Address structure for the client socket. */
     struct sockaddr_in cli_addr = {};
@@ -125,23 +350,27 @@ int main(int argc, char **argv) {
       fprintf(stderr, "ERROR accept(): %s\n", strerror(errno));
 	  continue;
     }
+    TRACE_POINT(TRACE_ACCEPT, cli_socket);
 
     /* Get data from client. */
-    if ( (n = read(cli_socket, buffer, sizeof(buffer))) <= 0 ) {
+    TRACE_POINT(TRACE_READ_BEGIN, cli_socket);
+    n = read(cli_socket, buffer, sizeof(buffer));
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( n <= 0 ) {
       fprintf(stderr, "ERROR read(): %s\n", strerror(errno));
       exit(5);
     }
     buffer[n] = '\0';
-    
-    /* Print recived data. */
-    printf("Recived:\n%s\n\n", buffer);
 
     /* Clear buffer and copy message to send to the buffer. */
     bzero(buffer, MAX_MSG_LEN);
     strcpy(buffer, "Hello client!");
 
     /* Send data. */
-    if ( write(cli_socket, buffer, sizeof(buffer)) <= 0 ) {
+    TRACE_POINT(TRACE_WRITE_BEGIN, cli_socket);
+    n = write(cli_socket, buffer, sizeof(buffer));
+    TRACE_POINT(TRACE_WRITE_END, n);
+    if ( n <= 0 ) {
       fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
       exit(6);
     }
@@ -151,6 +380,7 @@ int main(int argc, char **argv) {
 
     /* Close client socket. */
     close(cli_socket);
+    TRACE_POINT(TRACE_CLOSE, cli_socket);
   }
 
   return 0;
@@ -168,6 +398,639 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port to listen (default port is \"8888\")\n");
+	printf("       -k            serve key-value cache protocol (see kv_proto.h)\n");
+	printf("       -w [count]    cache workers, worker i listens on port + i (default 1)\n");
+	printf("       -m [MiB]      cache memory of all workers (default 64)\n");
+	printf("       -M [MiB]      read buffers of all cache connections (default 64)\n");
+	printf("       -e [engine]   greet all clients at once with coroutines\n");
+	printf("                     on event engine: poll or epoll\n");
 	printf("\n");
 	printf("\n");
 }
+
+
+void kv_serve(struct sockaddr_in *addr, int workers, size_t mem_mb) {
+  static struct kv_worker w[MAX_WORKERS];
+  size_t mem = (mem_mb << 20) / workers;
+
+  /* Peer closing the connection is handled by write() error. */
+  signal(SIGPIPE, SIG_IGN);
+
+  for ( int i = 0; i < workers; i++ ) {
+    struct sockaddr_in waddr = *addr;
+    waddr.sin_port = htons(ntohs(addr->sin_port) + i);
+
+    w[i].id = i;
+    w[i].listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if ( w[i].listen_fd < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      exit(2);
+    }
+    int on = 1;
+    setsockopt(w[i].listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ( bind(w[i].listen_fd, (struct sockaddr*) &waddr, sizeof(waddr)) < 0 ) {
+      fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+      exit(3);
+    }
+    if ( listen(w[i].listen_fd, SOMAXCONN) ) {
+      fprintf(stderr, "ERROR listen(): %s\n", strerror(errno));
+      exit(4);
+    }
+    if ( kv_shard_init(&w[i].shard, mem) < 0 ) {
+      fprintf(stderr, "ERROR: cannot allocate %zu MiB for the cache.\n", mem >> 20);
+      exit(2);
+    }
+    printf("Worker %d listening on port %d...\n", i, ntohs(waddr.sin_port));
+  }
+
+  for ( int i = 0; i < workers; i++ ) {
+    if ( pthread_create(&w[i].thread, NULL, kv_worker_func, &w[i]) != 0 ) {
+      fprintf(stderr, "ERROR pthread_create()\n");
+      exit(2);
+    }
+  }
+  for ( int i = 0; i < workers; i++ ) {
+    pthread_join(w[i].thread, NULL);
+  }
+  exit(0);
+}
+
+
+void hello_serve(int serv_socket, enum coro_engine_kind kind) {
+  struct coro_engine e;
+
+  /* Client closing early is handled by write() error. */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ( coro_engine_init(&e, kind, coro_fd_limit()) < 0 ) {
+    fprintf(stderr, "ERROR coro_engine_init(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  struct coro_acceptor *a = calloc(1, sizeof(*a));
+  if ( a == NULL ) {
+    fprintf(stderr, "ERROR calloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+  fcntl(serv_socket, F_SETFL, fcntl(serv_socket, F_GETFL) | O_NONBLOCK);
+  a->co.fn = coro_accept_fn;
+  a->co.fd = serv_socket;
+  a->e = &e;
+  a->handler = hello_coro_fn;
+  a->size = sizeof(struct hello_coro);
+  coro_spawn(&e, &a->co);
+
+  printf("Waiting for connection...\n");
+  coro_engine_run(&e, NULL);
+  exit(0);
+}
+
+
+int hello_coro_fn(struct coro *c) {
+  struct hello_coro *h = (struct hello_coro *) c;
+
+  /* Same greeting as the blocking server: whole buffer, zero padded. */
+  static const char greeting[MAX_MSG_LEN] = "Hello client!";
+  static char buffer[MAX_MSG_LEN];
+
+  CORO_BEGIN(c);
+  TRACE_POINT(TRACE_ACCEPT, c->fd);
+
+  TRACE_POINT(TRACE_READ_BEGIN, c->fd);
+  CORO_AWAIT(c, CORO_READ, read(c->fd, buffer, sizeof(buffer)));
+  TRACE_POINT(TRACE_READ_END, c->ret);
+  if ( c->ret <= 0 ) {
+    fprintf(stderr, "ERROR read(): %s\n", c->ret < 0 ? strerror(errno) : "connection closed");
+    return CORO_DONE;
+  }
+
+  TRACE_POINT(TRACE_WRITE_BEGIN, c->fd);
+  while ( h->off < sizeof(greeting) ) {
+    CORO_AWAIT(c, CORO_WRITE, write(c->fd, greeting + h->off, sizeof(greeting) - h->off));
+    if ( c->ret <= 0 ) {
+      fprintf(stderr, "ERROR write(): %s\n", strerror(errno));
+      return CORO_DONE;
+    }
+    h->off += c->ret;
+  }
+  TRACE_POINT(TRACE_WRITE_END, h->off);
+
+  TRACE_POINT(TRACE_CLOSE, c->fd);
+  CORO_END(c);
+}
+
+
+int kv_shard_init(struct kv_shard *s, size_t mem) {
+  memset(s, 0, sizeof(*s));
+
+  s->n_pages = mem >> KV_PAGE_SHIFT;
+  if ( s->n_pages == 0 ) {
+    return -1;
+  }
+  s->arena = mmap(NULL, (size_t) s->n_pages << KV_PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( s->arena == MAP_FAILED ) {
+    return -1;
+  }
+
+  /* Enough slots for the arena full of the smallest items. */
+  size_t buckets = 1;
+  while ( buckets * KV_WAYS < ((size_t) s->n_pages << (KV_PAGE_SHIFT - KV_MIN_SHIFT)) ) {
+    buckets <<= 1;
+  }
+  s->mask = buckets - 1;
+  s->table = aligned_alloc(64, buckets * sizeof(struct kv_bucket));
+  if ( s->table == NULL ) {
+    return -1;
+  }
+  memset(s->table, 0, buckets * sizeof(struct kv_bucket));
+
+  for ( int c = 0; c < KV_CLASSES; c++ ) {
+    s->classes[c].pages = calloc(s->n_pages, sizeof(uint32_t));
+    if ( s->classes[c].pages == NULL ) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Tag of the hash, never 0 (0 marks empty slot). */
+static inline uint32_t kv_tag(uint64_t hash) {
+  return (uint32_t) (hash >> 32) | 1;
+}
+
+
+static inline struct kv_item *kv_item_at(struct kv_shard *s, uint32_t idx) {
+  return (struct kv_item *) (s->arena + ((size_t) idx << KV_MIN_SHIFT));
+}
+
+
+static inline uint32_t kv_index_of(struct kv_shard *s, struct kv_item *it) {
+  return (uint32_t) (((char *) it - s->arena) >> KV_MIN_SHIFT);
+}
+
+
+uint32_t *kv_find(struct kv_shard *s, uint64_t hash, const char *key, size_t key_len) {
+  uint32_t tag = kv_tag(hash);
+
+  for ( int p = 0; p < KV_PROBE; p++ ) {
+    struct kv_bucket *b = &s->table[(hash + p) & s->mask];
+    for ( int i = 0; i < KV_WAYS; i++ ) {
+      if ( b->tags[i] != tag ) {
+        continue;
+      }
+      struct kv_item *it = kv_item_at(s, b->items[i]);
+      if ( it->hash == hash && it->key_len == key_len && memcmp(it->data, key, key_len) == 0 ) {
+        return &b->tags[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+/* Remove the item from the hash table (used by eviction). */
+static void kv_unlink(struct kv_shard *s, struct kv_item *it) {
+  uint32_t tag = kv_tag(it->hash), idx = kv_index_of(s, it);
+
+  for ( int p = 0; p < KV_PROBE; p++ ) {
+    struct kv_bucket *b = &s->table[(it->hash + p) & s->mask];
+    for ( int i = 0; i < KV_WAYS; i++ ) {
+      if ( b->tags[i] == tag && b->items[i] == idx ) {
+        b->tags[i] = 0;
+        return;
+      }
+    }
+  }
+}
+
+
+/* Split the page into free chunks of the class. */
+static void kv_carve(struct kv_shard *s, int cls, uint32_t page) {
+  struct kv_class *k = &s->classes[cls];
+  uint32_t chunks = KV_PAGE >> (KV_MIN_SHIFT + cls);
+  uint32_t step = 1 << cls;
+
+  k->pages[k->n_pages++] = page;
+  for ( uint32_t i = chunks; i-- > 0; ) {
+    uint32_t idx = (page << (KV_PAGE_SHIFT - KV_MIN_SHIFT)) + i * step;
+    struct kv_item *it = kv_item_at(s, idx);
+    it->flags = 0;
+    it->cls = cls;
+    it->next_free = k->free;
+    k->free = idx + 1;
+  }
+}
+
+
+/* Move the page under the CLOCK hand of the biggest class to the class,
+ * so sizes of classes follow the workload when memory is full. */
+static void kv_steal_page(struct kv_shard *s, int cls) {
+  struct kv_class *k = &s->classes[cls];
+  int donor = -1;
+
+  for ( int c = 0; c < KV_CLASSES; c++ ) {
+    if ( c != cls && (donor < 0 || s->classes[c].n_pages > s->classes[donor].n_pages) ) {
+      donor = c;
+    }
+  }
+  struct kv_class *d = &s->classes[donor];
+  if ( d->n_pages == 0 || (k->n_pages > 0 && d->n_pages <= k->n_pages + 1) ) {
+    return;
+  }
+
+  uint32_t page = d->pages[d->hand_page];
+  uint32_t first = page << (KV_PAGE_SHIFT - KV_MIN_SHIFT);
+  uint32_t last = first + (KV_PAGE >> KV_MIN_SHIFT);
+  uint32_t step = 1 << donor;
+
+  /* Evict items of the page. */
+  for ( uint32_t idx = first; idx < last; idx += step ) {
+    struct kv_item *it = kv_item_at(s, idx);
+    if ( it->flags & KV_ITEM_USED ) {
+      kv_unlink(s, it);
+      s->evictions++;
+    }
+  }
+
+  /* Drop free chunks of the page from the free list of the donor. */
+  uint32_t *link = &d->free;
+  while ( *link ) {
+    struct kv_item *it = kv_item_at(s, *link - 1);
+    if ( *link - 1 >= first && *link - 1 < last ) {
+      *link = it->next_free;
+    } else {
+      link = &it->next_free;
+    }
+  }
+
+  d->pages[d->hand_page] = d->pages[--d->n_pages];
+  if ( d->hand_page >= d->n_pages ) {
+    d->hand_page = 0;
+  }
+  d->hand_chunk = 0;
+
+  kv_carve(s, cls, page);
+}
+
+
+struct kv_item *kv_alloc(struct kv_shard *s, size_t size) {
+  int cls = 0;
+  while ( cls < KV_CLASSES && ((size_t) KV_MIN_CHUNK << cls) < size ) {
+    cls++;
+  }
+  if ( cls == KV_CLASSES ) {
+    return NULL;
+  }
+  struct kv_class *k = &s->classes[cls];
+  uint32_t chunks = KV_PAGE >> (KV_MIN_SHIFT + cls);
+  uint32_t step = 1 << cls;
+
+  /* Take a new page while the arena has some, then rebalance pages
+   * when the class has none or every KV_REBALANCE evictions. */
+  if ( k->free == 0 ) {
+    if ( s->used_pages < s->n_pages ) {
+      kv_carve(s, cls, s->used_pages++);
+    } else if ( k->n_pages == 0 || ++k->evictions % KV_REBALANCE == 0 ) {
+      kv_steal_page(s, cls);
+    }
+  }
+
+  if ( k->free ) {
+    struct kv_item *it = kv_item_at(s, k->free - 1);
+    k->free = it->next_free;
+    it->flags = KV_ITEM_USED;
+    return it;
+  }
+  if ( k->n_pages == 0 ) {
+    return NULL;
+  }
+
+  /* CLOCK: skip (and clear) referenced items, evict the first other. */
+  while ( 1 ) {
+    uint32_t idx = (k->pages[k->hand_page] << (KV_PAGE_SHIFT - KV_MIN_SHIFT)) + k->hand_chunk * step;
+    if ( ++k->hand_chunk == chunks ) {
+      k->hand_chunk = 0;
+      k->hand_page = (k->hand_page + 1) % k->n_pages;
+    }
+    struct kv_item *it = kv_item_at(s, idx);
+    if ( it->flags & KV_ITEM_REF ) {
+      it->flags &= ~KV_ITEM_REF;
+      continue;
+    }
+    if ( it->flags & KV_ITEM_USED ) {
+      kv_unlink(s, it);
+      s->evictions++;
+      it->flags = KV_ITEM_USED;
+      return it;
+    }
+  }
+}
+
+
+void kv_free(struct kv_shard *s, struct kv_item *it) {
+  struct kv_class *k = &s->classes[it->cls];
+
+  it->flags = 0;
+  it->next_free = k->free;
+  k->free = kv_index_of(s, it) + 1;
+}
+
+
+int kv_set(struct kv_shard *s, uint64_t hash, const char *key, size_t key_len,
+           const char *val, size_t val_len) {
+
+  /* Allocate first, eviction may change the table. */
+  struct kv_item *it = kv_alloc(s, sizeof(struct kv_item) + key_len + val_len);
+  if ( it == NULL ) {
+    return KV_ERROR;
+  }
+  it->hash = hash;
+  it->key_len = key_len;
+  it->val_len = val_len;
+  memcpy(it->data, key, key_len);
+  memcpy(it->data + key_len, val, val_len);
+  uint32_t idx = kv_index_of(s, it);
+
+  /* Replace the old value. */
+  uint32_t *tag = kv_find(s, hash, key, key_len);
+  if ( tag ) {
+    uint32_t *slot = tag + KV_WAYS;
+    kv_free(s, kv_item_at(s, *slot));
+    *slot = idx;
+    return KV_OK;
+  }
+
+  /* Take an empty slot, or the first not recently used one. */
+  uint32_t *victim = NULL;
+  for ( int p = 0; p < KV_PROBE && !(victim && *victim == 0); p++ ) {
+    struct kv_bucket *b = &s->table[(hash + p) & s->mask];
+    for ( int i = 0; i < KV_WAYS; i++ ) {
+      if ( b->tags[i] == 0 ) {
+        victim = &b->tags[i];
+        break;
+      }
+      if ( victim == NULL && !(kv_item_at(s, b->items[i])->flags & KV_ITEM_REF) ) {
+        victim = &b->tags[i];
+      }
+    }
+  }
+  if ( victim == NULL ) {
+    victim = &s->table[hash & s->mask].tags[0];
+  }
+  if ( *victim ) {
+    kv_free(s, kv_item_at(s, victim[KV_WAYS]));
+    s->evictions++;
+  }
+  *victim = kv_tag(hash);
+  victim[KV_WAYS] = idx;
+
+  return KV_OK;
+}
+
+
+/* Append response to the write buffer of the connection. */
+static int kv_respond(struct kv_conn *c, int status, const char *val, size_t val_len) {
+  size_t need = c->wlen + sizeof(struct kv_resp_hdr) + val_len;
+
+  if ( need > c->wcap ) {
+    size_t cap = c->wcap ? c->wcap : KV_WBUF;
+    while ( cap < need ) {
+      cap *= 2;
+    }
+    char *buf = realloc(c->wbuf, cap);
+    if ( buf == NULL ) {
+      return -1;
+    }
+    c->wbuf = buf;
+    c->wcap = cap;
+  }
+
+  struct kv_resp_hdr hdr = { .status = status, .val_len = htonl(val_len) };
+  memcpy(c->wbuf + c->wlen, &hdr, sizeof(hdr));
+  memcpy(c->wbuf + c->wlen + sizeof(hdr), val, val_len);
+  c->wlen = need;
+
+  return 0;
+}
+
+
+int kv_process(struct kv_shard *s, struct kv_conn *c) {
+  size_t off = 0, need = 0;
+
+  while ( c->wlen < KV_WBUF_HIGH && c->in.len - off >= sizeof(struct kv_req_hdr) ) {
+    struct kv_req_hdr hdr;
+    memcpy(&hdr, c->in.data + off, sizeof(hdr));
+    size_t key_len = ntohs(hdr.key_len);
+    size_t val_len = ntohl(hdr.val_len);
+
+    if ( key_len == 0 || key_len > KV_MAX_KEY || val_len > KV_PAGE ) {
+      return -1;
+    }
+    size_t total = sizeof(hdr) + key_len + val_len;
+    if ( c->in.len - off < total ) {
+      need = total;
+      break;
+    }
+
+    const char *key = c->in.data + off + sizeof(hdr);
+    uint64_t hash = kv_hash(key, key_len);
+    uint32_t *tag;
+    int r = 0;
+
+    switch ( hdr.op ) {
+      case KV_GET:
+        if ( (tag = kv_find(s, hash, key, key_len)) != NULL ) {
+          struct kv_item *it = kv_item_at(s, tag[KV_WAYS]);
+          it->flags |= KV_ITEM_REF;
+          r = kv_respond(c, KV_OK, it->data + it->key_len, it->val_len);
+        } else {
+          r = kv_respond(c, KV_NOT_FOUND, NULL, 0);
+        }
+        break;
+      case KV_SET:
+        r = kv_respond(c, kv_set(s, hash, key, key_len, key + key_len, val_len), NULL, 0);
+        break;
+      case KV_DEL:
+        if ( (tag = kv_find(s, hash, key, key_len)) != NULL ) {
+          kv_free(s, kv_item_at(s, tag[KV_WAYS]));
+          *tag = 0;
+          r = kv_respond(c, KV_OK, NULL, 0);
+        } else {
+          r = kv_respond(c, KV_NOT_FOUND, NULL, 0);
+        }
+        break;
+      default:
+        return -1;
+    }
+    if ( r < 0 ) {
+      return -1;
+    }
+    off += total;
+  }
+
+  /* Keep incomplete request at the beginning of the buffer, with room
+   * for all of it. */
+  rbuf_consume(&c->in, off);
+
+  return rbuf_reserve(&c->in, need);
+}
+
+
+/* Close the connection and release its buffers. */
+static void kv_close(struct kv_conn *c) {
+  close(c->fd);
+  TRACE_POINT(TRACE_CLOSE, c->fd);
+  rbuf_free(&c->in);
+  free(c->wbuf);
+  free(c);
+}
+
+
+/* Write unsent responses until the socket is full.
+ * Return -1 if connection should be closed. */
+static int kv_flush(struct kv_conn *c) {
+  while ( c->woff < c->wlen ) {
+    TRACE_POINT(TRACE_WRITE_BEGIN, c->fd);
+    ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+    TRACE_POINT(TRACE_WRITE_END, n);
+    if ( n < 0 ) {
+      if ( errno == EAGAIN ) {
+        break;
+      }
+      return -1;
+    }
+    c->woff += n;
+  }
+  if ( c->woff == c->wlen ) {
+    c->woff = c->wlen = 0;
+  }
+
+  return 0;
+}
+
+
+/* Read available data (at most KV_READ_BATCH reads, so one client does
+ * not starve the others of the worker), process it and write responses.
+ * Client which does not read its responses is not read either: at
+ * KV_WBUF_HIGH unsent bytes EPOLLIN is dropped until they drain.
+ * Return -1 if connection should be closed. */
+static int kv_conn_io(struct kv_shard *s, struct kv_conn *c, int ep, bool readable) {
+  int reads = 0;
+
+  while ( 1 ) {
+    /* Requests left in the buffer by the high-water mark go first. */
+    if ( kv_process(s, c) < 0 ) {
+      return -1;
+    }
+    if ( c->wlen >= KV_WBUF_HIGH ) {
+      if ( kv_flush(c) < 0 ) {
+        return -1;
+      }
+      if ( c->wlen >= KV_WBUF_HIGH ) {
+        break;
+      }
+      continue;
+    }
+    if ( !readable || reads++ == KV_READ_BATCH ) {
+      break;
+    }
+
+    TRACE_POINT(TRACE_READ_BEGIN, c->fd);
+    ssize_t n = rbuf_read(&c->in);
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( n == 0 ) {
+      return -1;
+    }
+    if ( n < 0 ) {
+      if ( errno == EAGAIN ) {
+        break;
+      }
+      return -1;
+    }
+  }
+
+  /* All responses of the batch go out in one write(). */
+  if ( kv_flush(c) < 0 ) {
+    return -1;
+  }
+
+  /* Wait for EPOLLOUT only while there are unsent responses, for
+   * EPOLLIN only below the high-water mark. */
+  bool want_out = c->wlen > 0;
+  bool stop_in = c->wlen >= KV_WBUF_HIGH;
+  if ( want_out != c->want_out || stop_in != c->stop_in ) {
+    struct epoll_event ev = {
+      .events = (stop_in ? 0 : EPOLLIN) | (want_out ? EPOLLOUT : 0),
+      .data.ptr = c
+    };
+    if ( epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) < 0 ) {
+      fprintf(stderr, "ERROR epoll_ctl(): %s\n", strerror(errno));
+      return -1;
+    }
+    c->want_out = want_out;
+    c->stop_in = stop_in;
+  }
+
+  return 0;
+}
+
+
+void *kv_worker_func(void *arg) {
+  struct kv_worker *w = arg;
+  struct epoll_event events[KV_EVENTS];
+
+  int ep = epoll_create1(0);
+  if ( ep < 0 ) {
+    fprintf(stderr, "ERROR epoll_create1(): %s\n", strerror(errno));
+    exit(2);
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if ( epoll_ctl(ep, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0 ) {
+    fprintf(stderr, "ERROR epoll_ctl(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  while ( 1 ) {
+    int n = epoll_wait(ep, events, KV_EVENTS, -1);
+    if ( n < 0 && errno != EINTR ) {
+      fprintf(stderr, "ERROR epoll_wait(): %s\n", strerror(errno));
+      exit(2);
+    }
+
+    for ( int i = 0; i < n; i++ ) {
+      struct kv_conn *c = events[i].data.ptr;
+
+      /* Listening socket, accept all pending connections. */
+      if ( c == NULL ) {
+        int fd;
+        while ( (fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0 ) {
+          TRACE_POINT(TRACE_ACCEPT, fd);
+          c = calloc(1, sizeof(*c));
+          if ( c == NULL || rbuf_init(&c->in, fd, 0, KV_MAX_REQ) < 0 ) {
+            free(c);
+            close(fd);
+            continue;
+          }
+          c->fd = fd;
+          struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+          if ( epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev) < 0 ) {
+            fprintf(stderr, "ERROR epoll_ctl(): %s\n", strerror(errno));
+            kv_close(c);
+          }
+        }
+        continue;
+      }
+
+      bool readable = events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+      if ( kv_conn_io(&w->shard, c, ep, readable) < 0 ) {
+        kv_close(c);
+      }
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,252 @@
+/* File:         wcoalesce.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Write coalescing for TCP sockets, shared by the echo
+ *               client and server. Small messages are queued as
+ *               iovecs and go out in one writev()/sendmsg() when the
+ *               byte budget is reached, the delay budget expires or
+ *               the caller has nothing more to send.
+ *
+ *               WCO_OFF     every message is written at once (no
+ *                           coalescing, one syscall per message)
+ *               WCO_WRITEV  gather messages into one writev()
+ *               WCO_CORK    as WCO_WRITEV, TCP_CORK holds partial
+ *                           segments until the final flush
+ *               WCO_MORE    as WCO_CORK, but with MSG_MORE (no extra
+ *                           setsockopt() per flush)
+ *
+ *               TCP_NODELAY is adapted to the traffic: it is on while
+ *               flushes carry single messages (request/response, Nagle
+ *               would only delay them) and off while they carry
+ *               batches.
+ *
+ *               Queued buffers are owned by the caller and must stay
+ *               valid until the next flush.
+ */
+
+#ifndef WCOALESCE_H
+#define WCOALESCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/tcp.h>
+
+#define WCO_MAX_IOV 64
+#define WCO_BYTES 16384              /* default byte budget */
+#define WCO_NODELAY_BATCH 24         /* 1.5 messages per flush, in 1/16 */
+
+enum wco_mode {
+  WCO_OFF,
+  WCO_WRITEV,
+  WCO_CORK,
+  WCO_MORE
+};
+
+/* Write queue of one connection. */
+struct wco {
+  int fd;
+  enum wco_mode mode;
+  size_t max_bytes;                  /* byte budget of one flush */
+  uint64_t max_delay_ns;             /* delay budget of the first message */
+  struct iovec iov[WCO_MAX_IOV];
+  int niov;
+  size_t bytes;
+  uint64_t first_ns;                 /* first message of the batch queued */
+  bool corked;
+  int nodelay;                       /* -1 unknown, else TCP_NODELAY state */
+  unsigned avg_batch;                /* messages per flush, EWMA in 1/16 */
+  uint64_t msgs, flushes, syscalls;
+};
+
+
+/**
+ * Function parse coalescing mode name.
+ *
+ * @return mode or -1 if the name is unknown
+ */
+static inline int wco_parse_mode(const char *name) {
+  static const char *names[] = { "off", "writev", "cork", "more" };
+
+  for ( int i = 0; i < 4; i++ ) {
+    if ( strcmp(name, names[i]) == 0 ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+static inline uint64_t wco_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Function prepare write queue of the socket.
+ *
+ * @param max_bytes is a byte budget (0 = WCO_BYTES)
+ * @param max_delay_us is a delay budget of the first queued message
+ */
+static inline void wco_init(struct wco *w, int fd, enum wco_mode mode, size_t max_bytes, unsigned max_delay_us) {
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+  w->mode = mode;
+  w->max_bytes = max_bytes ? max_bytes : WCO_BYTES;
+  w->max_delay_ns = max_delay_us * 1000ULL;
+  w->nodelay = -1;
+}
+
+
+static inline void wco_setopt(struct wco *w, int opt, int on) {
+  setsockopt(w->fd, IPPROTO_TCP, opt, &on, sizeof(on));
+  w->syscalls++;
+}
+
+
+/**
+ * Function write all queued messages.
+ *
+ * @param more is true if more data follows at once (budget reached in
+ *        the middle of a batch), kernel may then hold a partial segment
+ * @return 0 on success, -1 on error
+ */
+static inline int wco_flush(struct wco *w, bool more) {
+  if ( w->niov == 0 ) {
+    return 0;
+  }
+
+  /* Adaptive Nagle: single messages want NODELAY, batches do not. */
+  if ( w->mode != WCO_OFF && !more ) {
+    w->avg_batch = (w->avg_batch * 7 + w->niov * 16) / 8;
+    int want = w->avg_batch < WCO_NODELAY_BATCH;
+    if ( want != w->nodelay ) {
+      wco_setopt(w, TCP_NODELAY, want);
+      w->nodelay = want;
+    }
+  }
+
+  if ( w->mode == WCO_CORK && !w->corked ) {
+    wco_setopt(w, TCP_CORK, 1);
+    w->corked = true;
+  }
+
+  struct iovec *iov = w->iov;
+  int niov = w->niov;
+
+  while ( niov > 0 ) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = niov };
+    ssize_t n = sendmsg(w->fd, &msg, w->mode == WCO_MORE && more ? MSG_MORE : 0);
+    w->syscalls++;
+
+    if ( n < 0 && errno == EAGAIN ) {
+      /* Non-blocking socket with a full send buffer. */
+      struct pollfd pfd = { .fd = w->fd, .events = POLLOUT };
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      return -1;
+    }
+
+    /* Skip what was written, partial write leaves a shorter iovec. */
+    while ( niov > 0 && (size_t) n >= iov->iov_len ) {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if ( niov > 0 ) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  if ( w->corked && !more ) {
+    wco_setopt(w, TCP_CORK, 0);
+    w->corked = false;
+  }
+
+  w->flushes++;
+  w->niov = 0;
+  w->bytes = 0;
+
+  return 0;
+}
+
+
+/**
+ * Function queue message, flush if a budget is reached.
+ *
+ * @return 0 on success, -1 on write error
+ */
+static inline int wco_queue(struct wco *w, const void *buf, size_t len) {
+  if ( w->niov == 0 ) {
+    w->first_ns = w->max_delay_ns ? wco_now_ns() : 0;
+  }
+  w->iov[w->niov++] = (struct iovec) { .iov_base = (void *) buf, .iov_len = len };
+  w->bytes += len;
+  w->msgs++;
+
+  if ( w->mode == WCO_OFF ) {
+    return wco_flush(w, false);
+  }
+  if ( w->bytes >= w->max_bytes || w->niov == WCO_MAX_IOV ) {
+    return wco_flush(w, true);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Function return how long the queued messages may still wait.
+ *
+ * @return nanoseconds, 0 if they have to be flushed now
+ */
+static inline uint64_t wco_wait_ns(const struct wco *w) {
+  if ( w->niov == 0 || w->max_delay_ns == 0 ) {
+    return 0;
+  }
+
+  uint64_t waited = wco_now_ns() - w->first_ns;
+  return waited < w->max_delay_ns ? w->max_delay_ns - waited : 0;
+}
+
+
+/**
+ * Function read TCP segment counters of the socket.
+ *
+ * @param out is a number of sent segments (including pure ACKs)
+ * @param data_out is a number of sent segments carrying data
+ * @param in is a number of received segments
+ * @return 0 on success, -1 if kernel does not report them
+ */
+static inline int wco_segments(int fd, uint64_t *out, uint64_t *data_out, uint64_t *in) {
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  memset(&ti, 0, sizeof(ti));
+  if ( getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 ||
+       len < offsetof(struct tcp_info, tcpi_data_segs_out) + sizeof(ti.tcpi_data_segs_out) ) {
+    return -1;
+  }
+  *out = ti.tcpi_segs_out;
+  *data_out = ti.tcpi_data_segs_out;
+  *in = ti.tcpi_segs_in;
+
+  return 0;
+}
+
+#endif /* WCOALESCE_H */
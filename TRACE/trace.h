@@ -0,0 +1,326 @@
+/* File:         trace.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Compile-time gated tracepoints for the hot paths of
+ *               the servers. Without any flag every probe compiles
+ *               to nothing.
+ *
+ *               -DTRACE       records go to a per-thread lock-free
+ *                             ring buffer, a dumper thread drains the
+ *                             rings into a binary trace file (path from
+ *                             TRACE_FILE variable, default "trace.bin").
+ *                             Link with -pthread.
+ *               -DTRACE_USDT  probes are also USDT probes (sys/sdt.h),
+ *                             so they can be attached by perf/bpftrace.
+ *
+ *               Trace file is converted to per-phase timing by
+ *               trace_report.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "NPTRACE1"
+
+/* Events recorded by the probes. */
+enum trace_event {
+  TRACE_ACCEPT = 1,   /* connection accepted, arg is a socket */
+  TRACE_READ_BEGIN,   /* before read()/recvfrom(), arg is a socket */
+  TRACE_READ_END,     /* after read()/recvfrom(), arg is a result */
+  TRACE_WRITE_BEGIN,  /* before write()/sendto(), arg is a socket */
+  TRACE_WRITE_END,    /* after write()/sendto(), arg is a result */
+  TRACE_CLOSE,        /* connection closed, arg is a socket */
+  TRACE_EVENT_MAX
+};
+
+/* Record as stored in the trace file (after the file header). */
+struct trace_record {
+  uint64_t ts_ns;      /* CLOCK_MONOTONIC timestamp */
+  uint32_t tid;        /* thread id */
+  uint16_t event;      /* enum trace_event */
+  uint16_t reserved;
+  int64_t arg;
+};
+
+/* Header of the trace file. */
+struct trace_file_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t reserved;
+};
+
+
+#ifdef TRACE_USDT
+#include <sys/sdt.h>
+#define TRACE_USDT_PROBE(ev, arg) DTRACE_PROBE2(netprog, ev, (int) (ev), (long) (arg))
+#else
+#define TRACE_USDT_PROBE(ev, arg) do { } while (0)
+#endif
+
+
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SIZE 8192        /* records per thread, power of 2 */
+#define TRACE_MAX_THREADS 256
+#define TRACE_DUMP_INTERVAL_MS 10
+
+/* Single producer (owner thread), single consumer (dumper) ring. Ring
+ * of an exited thread is released and taken over by the next new
+ * thread, pending records stay in it until the dumper drains them. */
+struct trace_ring {
+  _Alignas(64) _Atomic uint64_t head;   /* written by owner thread */
+  _Alignas(64) _Atomic uint64_t tail;   /* written by dumper */
+  _Alignas(64) _Atomic uint64_t dropped;
+  _Atomic int in_use;                   /* owned by a running thread */
+  uint32_t tid;
+  struct trace_record rec[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *_Atomic trace_rings[TRACE_MAX_THREADS];
+static _Atomic int trace_nrings;
+static __thread struct trace_ring *trace_self;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_t trace_dumper;
+static _Atomic int trace_stop_sig;
+static _Atomic int trace_stopped;
+static FILE *trace_file;
+
+
+/**
+ * Function copy all pending records from the rings into the trace file.
+ */
+static void trace_drain(void) {
+  int nrings = atomic_load_explicit(&trace_nrings, memory_order_acquire);
+
+  for ( int i = 0; i < nrings; i++ ) {
+    struct trace_ring *r = atomic_load_explicit(&trace_rings[i], memory_order_acquire);
+    if ( r == NULL ) {
+      continue;
+    }
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    /* Write at most two contiguous chunks. */
+    while ( tail != head ) {
+      uint64_t idx = tail & (TRACE_RING_SIZE - 1);
+      uint64_t cnt = head - tail;
+      if ( cnt > TRACE_RING_SIZE - idx ) {
+        cnt = TRACE_RING_SIZE - idx;
+      }
+      fwrite(&r->rec[idx], sizeof(struct trace_record), cnt, trace_file);
+      tail += cnt;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+  }
+  fflush(trace_file);
+}
+
+
+/**
+ * Function finish trace file: drain rings and report dropped records.
+ */
+static void trace_finish(void) {
+  if ( atomic_exchange(&trace_stopped, 1) ) {
+    return;
+  }
+  trace_drain();
+
+  uint64_t dropped = 0;
+  int nrings = atomic_load(&trace_nrings);
+  for ( int i = 0; i < nrings; i++ ) {
+    struct trace_ring *r = atomic_load_explicit(&trace_rings[i], memory_order_acquire);
+    if ( r ) {
+      dropped += atomic_load(&r->dropped);
+    }
+  }
+  if ( dropped ) {
+    fprintf(stderr, "TRACE: %llu records dropped (ring full).\n", (unsigned long long) dropped);
+  }
+  fclose(trace_file);
+}
+
+
+/**
+ * Dumper thread: periodically drain the rings. On SIGINT/SIGTERM finish
+ * the trace file and terminate the process with the original signal.
+ */
+static void *trace_dumper_func(void *arg) {
+  (void) arg;
+  const struct timespec interval = { 0, TRACE_DUMP_INTERVAL_MS * 1000000L };
+
+  while ( 1 ) {
+    nanosleep(&interval, NULL);
+
+    int sig = atomic_load(&trace_stop_sig);
+    if ( sig ) {
+      trace_finish();
+      signal(sig, SIG_DFL);
+      raise(sig);
+    }
+    if ( atomic_load(&trace_stopped) ) {
+      return NULL;
+    }
+    trace_drain();
+  }
+}
+
+
+static void trace_signal(int sig) {
+  atomic_store(&trace_stop_sig, sig);
+}
+
+
+/**
+ * Function release ring of an exiting thread (key destructor).
+ */
+static void trace_release(void *ring) {
+  struct trace_ring *r = ring;
+
+  trace_self = NULL;
+  atomic_store_explicit(&r->in_use, 0, memory_order_release);
+}
+
+
+static void trace_atexit(void) {
+  atomic_store(&trace_stopped, 1);
+  pthread_join(trace_dumper, NULL);
+  atomic_store(&trace_stopped, 0);
+  trace_finish();
+}
+
+
+/**
+ * Function open trace file and start dumper thread (once per process).
+ */
+static void trace_init(void) {
+  const char *path = getenv("TRACE_FILE");
+
+  trace_file = fopen(path ? path : "trace.bin", "wb");
+  if ( trace_file == NULL ) {
+    perror("ERROR fopen(trace)");
+    exit(1);
+  }
+
+  struct trace_file_header hdr = { .record_size = sizeof(struct trace_record) };
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  fwrite(&hdr, sizeof(hdr), 1, trace_file);
+
+  /* Catch termination only if program did not install its own handler. */
+  int sigs[] = { SIGINT, SIGTERM };
+  for ( size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++ ) {
+    struct sigaction old;
+    sigaction(sigs[i], NULL, &old);
+    if ( old.sa_handler == SIG_DFL ) {
+      struct sigaction sa = { .sa_handler = trace_signal, .sa_flags = SA_RESTART };
+      sigemptyset(&sa.sa_mask);
+      sigaction(sigs[i], &sa, NULL);
+    }
+  }
+
+  pthread_key_create(&trace_key, trace_release);
+  pthread_create(&trace_dumper, NULL, trace_dumper_func, NULL);
+  atexit(trace_atexit);
+}
+
+
+/**
+ * Function take a released ring or allocate and register a new one for
+ * the calling thread.
+ */
+static struct trace_ring *trace_register(void) {
+  pthread_once(&trace_once, trace_init);
+
+  struct trace_ring *r = NULL;
+  int nrings = atomic_load_explicit(&trace_nrings, memory_order_acquire);
+  for ( int i = 0; i < nrings && r == NULL; i++ ) {
+    struct trace_ring *f = atomic_load_explicit(&trace_rings[i], memory_order_acquire);
+    int free_ring = 0;
+    if ( f && atomic_compare_exchange_strong_explicit(&f->in_use, &free_ring, 1,
+                                                      memory_order_acquire, memory_order_relaxed) ) {
+      r = f;
+    }
+  }
+
+  if ( r == NULL ) {
+    int idx = atomic_fetch_add(&trace_nrings, 1);
+    if ( idx >= TRACE_MAX_THREADS ) {
+      atomic_fetch_sub(&trace_nrings, 1);
+      static _Atomic int warned;
+      if ( !atomic_exchange(&warned, 1) ) {
+        fprintf(stderr, "TRACE: more than %d threads at once, new threads are not traced.\n",
+                TRACE_MAX_THREADS);
+      }
+      return NULL;
+    }
+
+    r = aligned_alloc(64, sizeof(struct trace_ring));
+    if ( r == NULL ) {
+      return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->in_use = 1;
+    atomic_store_explicit(&trace_rings[idx], r, memory_order_release);
+  }
+  r->tid = (uint32_t) syscall(SYS_gettid);
+  pthread_setspecific(trace_key, r);
+
+  return r;
+}
+
+
+/**
+ * Function store one record in the ring of the calling thread.
+ * Never blocks, record is dropped when the ring is full.
+ */
+static inline void trace_emit(uint16_t event, int64_t arg) {
+  struct trace_ring *r = trace_self;
+
+  if ( __builtin_expect(r == NULL, 0) ) {
+    r = trace_self = trace_register();
+    if ( r == NULL ) {
+      return;
+    }
+  }
+
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if ( head - atomic_load_explicit(&r->tail, memory_order_acquire) >= TRACE_RING_SIZE ) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  struct trace_record *rec = &r->rec[head & (TRACE_RING_SIZE - 1)];
+  rec->ts_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  rec->tid = r->tid;
+  rec->event = event;
+  rec->reserved = 0;
+  rec->arg = arg;
+
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+#define TRACE_POINT(ev, arg) \
+  do { TRACE_USDT_PROBE(ev, arg); trace_emit((ev), (int64_t) (arg)); } while (0)
+
+#else
+
+#define TRACE_POINT(ev, arg) TRACE_USDT_PROBE(ev, arg)
+
+#endif /* TRACE */
+
+#endif /* TRACE_H */
@@ -0,0 +1,263 @@
+/* File:         trace_report.c
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Program converts binary trace file written by servers
+ *               built with -DTRACE into per-phase timing statistics.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_PATH "trace.bin"
+#define MAX_THREADS 1024
+
+
+/* Phases measured between pairs of events. */
+enum phase {
+  PHASE_READ,        /* READ_BEGIN -> READ_END (includes waiting) */
+  PHASE_PROCESS,     /* READ_END -> WRITE_BEGIN */
+  PHASE_WRITE,       /* WRITE_BEGIN -> WRITE_END */
+  PHASE_CONNECTION,  /* ACCEPT -> CLOSE */
+  PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+  "read (incl. wait)", "process", "write", "connection"
+};
+
+/* Growing array of phase durations. */
+struct samples {
+  uint64_t *v;
+  size_t n, cap;
+};
+
+/* Last event timestamps of a single thread. */
+struct thread_state {
+  uint32_t tid;
+  uint64_t last[TRACE_EVENT_MAX];
+};
+
+
+/**************************** FUNCTIONS *******************************/
+
+/**
+ * Function print help for user.
+ */
+void print_info();
+
+
+/**
+ * Function add duration to the samples.
+ *
+ * @param s is a samples array
+ * @param v is a duration in nanoseconds
+ */
+void samples_add(struct samples *s, uint64_t v);
+
+
+/**
+ * Function find state of the thread, creating it on first use.
+ *
+ * @param threads is an array of thread states
+ * @param n is a number of used entries
+ * @param tid is a thread id
+ * @return thread state or NULL if table is full
+ */
+struct thread_state *thread_find(struct thread_state *threads, size_t *n, uint32_t tid);
+
+
+/**
+ * Function compare two durations for qsort().
+ */
+int cmp_u64(const void *a, const void *b);
+
+/**********************************************************************/
+
+
+int main(int argc, char **argv) {
+
+  /* Set default trace file. */
+  const char *path = TRACE_PATH;
+
+  /* Parsing user arguments. */
+  int c, prev_ind;
+
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":f:h")) != -1 ) {
+	/* Case for "trace_report -f -h". */
+	if ( optind == prev_ind + 2 && *optarg == '-' ) {
+	  c = ':';
+	  --optind;
+	}
+	/* Other cases. */
+	switch ( c ) {
+	  case 'h':
+		print_info();
+		exit(1);
+	  case 'f':
+		path = optarg;
+		break;
+	  case ':':
+		printf("Option needs a value.\n");
+		exit(1);
+	  case '?':
+		fprintf(stderr, "Unknown option: %c.\n", optopt);
+		exit(1);
+	}
+  }
+
+  FILE *f = fopen(path, "rb");
+  if ( f == NULL ) {
+    fprintf(stderr, "ERROR fopen(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  /* Check file header. */
+  struct trace_file_header hdr;
+  if ( fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+       memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.record_size != sizeof(struct trace_record) ) {
+    fprintf(stderr, "ERROR: %s is not a trace file.\n", path);
+    exit(3);
+  }
+
+  static struct thread_state threads[MAX_THREADS];
+  size_t nthreads = 0;
+  struct samples phases[PHASE_MAX] = {};
+  uint64_t counts[TRACE_EVENT_MAX] = {};
+  uint64_t first_ts = 0, last_ts = 0, nrec = 0;
+
+  /* Records of one thread are in order, so pairing per thread is enough. */
+  struct trace_record rec;
+  while ( fread(&rec, sizeof(rec), 1, f) == 1 ) {
+    if ( rec.event == 0 || rec.event >= TRACE_EVENT_MAX ) {
+      continue;
+    }
+    if ( nrec++ == 0 || rec.ts_ns < first_ts ) {
+      first_ts = rec.ts_ns;
+    }
+    if ( rec.ts_ns > last_ts ) {
+      last_ts = rec.ts_ns;
+    }
+    counts[rec.event]++;
+
+    struct thread_state *t = thread_find(threads, &nthreads, rec.tid);
+    if ( t == NULL ) {
+      continue;
+    }
+
+    switch ( rec.event ) {
+      case TRACE_READ_END:
+        if ( t->last[TRACE_READ_BEGIN] ) {
+          samples_add(&phases[PHASE_READ], rec.ts_ns - t->last[TRACE_READ_BEGIN]);
+          t->last[TRACE_READ_BEGIN] = 0;
+        }
+        break;
+      case TRACE_WRITE_BEGIN:
+        if ( t->last[TRACE_READ_END] ) {
+          samples_add(&phases[PHASE_PROCESS], rec.ts_ns - t->last[TRACE_READ_END]);
+          t->last[TRACE_READ_END] = 0;
+        }
+        break;
+      case TRACE_WRITE_END:
+        if ( t->last[TRACE_WRITE_BEGIN] ) {
+          samples_add(&phases[PHASE_WRITE], rec.ts_ns - t->last[TRACE_WRITE_BEGIN]);
+          t->last[TRACE_WRITE_BEGIN] = 0;
+        }
+        break;
+      case TRACE_CLOSE:
+        if ( t->last[TRACE_ACCEPT] ) {
+          samples_add(&phases[PHASE_CONNECTION], rec.ts_ns - t->last[TRACE_ACCEPT]);
+          t->last[TRACE_ACCEPT] = 0;
+        }
+        break;
+    }
+    /* Event time is a start of the next phase. */
+    if ( rec.event != TRACE_CLOSE ) {
+      t->last[rec.event] = rec.ts_ns;
+    }
+  }
+  fclose(f);
+
+  printf("Records: %llu, threads: %zu, span: %.3f ms\n",
+         (unsigned long long) nrec, nthreads, (last_ts - first_ts) / 1e6);
+  printf("Accepted: %llu, reads: %llu, writes: %llu, closed: %llu\n\n",
+         (unsigned long long) counts[TRACE_ACCEPT], (unsigned long long) counts[TRACE_READ_END],
+         (unsigned long long) counts[TRACE_WRITE_END], (unsigned long long) counts[TRACE_CLOSE]);
+
+  printf("%-20s %10s %12s %12s %12s %12s %12s\n",
+         "phase [us]", "count", "min", "avg", "p50", "p99", "max");
+  for ( int p = 0; p < PHASE_MAX; p++ ) {
+    struct samples *s = &phases[p];
+    if ( s->n == 0 ) {
+      printf("%-20s %10d\n", phase_names[p], 0);
+      continue;
+    }
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    long double sum = 0;
+    for ( size_t i = 0; i < s->n; i++ ) {
+      sum += s->v[i];
+    }
+    printf("%-20s %10zu %12.3f %12.3f %12.3f %12.3f %12.3f\n",
+           phase_names[p], s->n, s->v[0] / 1e3, (double) (sum / s->n) / 1e3,
+           s->v[s->n / 2] / 1e3, s->v[(s->n * 99) / 100] / 1e3, s->v[s->n - 1] / 1e3);
+    free(s->v);
+  }
+  printf("\n");
+
+  return 0;
+}
+
+
+/*********************** FUNCTIONS DEFINITIONS ************************/
+
+void print_info() {
+	printf("Usage: trace_report -[OPTION] [VALUE]\n");
+	printf("       trace_report -[OPTION]\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("       -h            show this help\n");
+	printf("       -f [file]     set trace file (default file is \"trace.bin\")\n");
+	printf("\n");
+	printf("\n");
+}
+
+
+void samples_add(struct samples *s, uint64_t v) {
+  if ( s->n == s->cap ) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+    if ( s->v == NULL ) {
+      fprintf(stderr, "ERROR realloc(): %s\n", strerror(errno));
+      exit(4);
+    }
+  }
+  s->v[s->n++] = v;
+}
+
+
+struct thread_state *thread_find(struct thread_state *threads, size_t *n, uint32_t tid) {
+  for ( size_t i = 0; i < *n; i++ ) {
+    if ( threads[i].tid == tid ) {
+      return &threads[i];
+    }
+  }
+  if ( *n == MAX_THREADS ) {
+    return NULL;
+  }
+  memset(&threads[*n], 0, sizeof(threads[*n]));
+  threads[*n].tid = tid;
+  return &threads[(*n)++];
+}
+
+
+int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,161 @@
+/* File:         ratelimit.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Per source address rate limiting of the UDP server:
+ *               token bucket of every source in a fixed open addressing
+ *               table (RL_WAYS entries per cache line bucket, least
+ *               recently seen entry evicted) and a global ceiling.
+ *               Lookup cost is measured by BENCH/rl_bench.c.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define RL_BUCKET_BITS 12
+#define RL_BUCKETS (1 << RL_BUCKET_BITS)  /* rate limit table buckets */
+#define RL_WAYS 4              /* entries per bucket (one cache line) */
+#define RL_SCALE 1000          /* tokens are stored in 1/1000 units */
+#define RL_MAX_BURST 4000000   /* burst * RL_SCALE must fit in 32 bits */
+
+/* Token bucket of one source address (16 bytes). */
+struct rl_entry {
+  uint32_t addr;               /* source address, 0 if empty */
+  uint32_t tokens;             /* tokens * RL_SCALE */
+  uint64_t last_us;            /* last refill, also used for eviction */
+};
+
+/* Bucket of the open addressing table, one cache line. */
+struct rl_bucket {
+  _Alignas(64) struct rl_entry e[RL_WAYS];
+};
+
+/* Rate limiter configuration and drop counters. */
+struct rate_limit {
+  uint32_t rate;               /* per source packets per second, 0 = off */
+  uint32_t burst;              /* per source bucket size */
+  uint32_t global_rate;        /* global packets per second, 0 = off */
+  uint32_t global_burst;
+  struct rl_entry global;      /* global token bucket */
+  struct rl_bucket *table;
+  uint64_t received;
+  uint64_t dropped_global;
+  uint64_t dropped_source;
+  uint64_t evicted;
+};
+
+
+/**
+ * Function refill the token bucket and take one token from it.
+ * 
+ * @param e is a token bucket
+ * @param rate is a refill rate in tokens per second
+ * @param burst is a bucket size
+ * @param now_us is a current time in microseconds
+ * @return true if token was taken
+ */
+static inline bool rl_take(struct rl_entry *e, uint32_t rate, uint32_t burst, uint64_t now_us) {
+  uint64_t elapsed = now_us - e->last_us;
+  uint64_t max = (uint64_t) burst * RL_SCALE;
+
+  /* Long idle bucket is simply full (this also avoids overflow). */
+  uint64_t credit = elapsed >= 1000000ULL * burst / rate ? max : elapsed * rate * RL_SCALE / 1000000;
+
+  /* Keep the old time until at least one unit is credited, so slow
+   * rates are not rounded down to zero by frequent packets. */
+  if ( credit > 0 ) {
+    e->tokens = e->tokens + credit > max ? max : e->tokens + credit;
+    e->last_us = now_us;
+  }
+
+  if ( e->tokens < RL_SCALE ) {
+    return false;
+  }
+  e->tokens -= RL_SCALE;
+  return true;
+}
+
+
+/**
+ * Function decide if a datagram may be processed at the given time.
+ * Global ceiling is checked first, then the token bucket of the source
+ * address.
+ * 
+ * @param rl is a rate limiter
+ * @param addr is a source address (network order)
+ * @param now_us is a current time in microseconds
+ * @return true if datagram may be processed, false if it is dropped
+ */
+static inline bool rl_allow_at(struct rate_limit *rl, uint32_t addr, uint64_t now_us) {
+  if ( rl->global_rate && !rl_take(&rl->global, rl->global_rate, rl->global_burst, now_us) ) {
+    rl->dropped_global++;
+    return false;
+  }
+  if ( rl->rate == 0 ) {
+    return true;
+  }
+
+  /* Multiplicative hash selects one cache line with RL_WAYS entries. */
+  struct rl_bucket *b = &rl->table[(addr * 2654435761u) >> (32 - RL_BUCKET_BITS)];
+  struct rl_entry *e = NULL, *victim = &b->e[0];
+
+  for ( int i = 0; i < RL_WAYS; i++ ) {
+    if ( b->e[i].addr == addr ) {
+      e = &b->e[i];
+      break;
+    }
+    /* Empty entry has last_us == 0, so it is taken first. */
+    if ( b->e[i].last_us < victim->last_us ) {
+      victim = &b->e[i];
+    }
+  }
+
+  /* Unknown source replaces the least recently seen one. */
+  if ( e == NULL ) {
+    if ( victim->addr != 0 ) {
+      rl->evicted++;
+    }
+    e = victim;
+    e->addr = addr;
+    e->tokens = rl->burst * RL_SCALE;
+    e->last_us = now_us;
+  }
+
+  if ( !rl_take(e, rl->rate, rl->burst, now_us) ) {
+    rl->dropped_source++;
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Function decide if a datagram received now may be processed.
+ * 
+ * @param rl is a rate limiter
+ * @param addr is a source address (network order)
+ * @return true if datagram may be processed, false if it is dropped
+ */
+static inline bool rl_allow(struct rate_limit *rl, uint32_t addr) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return rl_allow_at(rl, addr, ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+
+/**
+ * Function print rate limiter counters.
+ */
+static inline void rl_print_stats(const struct rate_limit *rl) {
+  fprintf(stderr, "received %llu, dropped global %llu, dropped source %llu, evicted %llu\n",
+          (unsigned long long) rl->received, (unsigned long long) rl->dropped_global,
+          (unsigned long long) rl->dropped_source, (unsigned long long) rl->evicted);
+}
+
+
+#endif /* RATELIMIT_H */
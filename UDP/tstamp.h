@@ -0,0 +1,133 @@
+/* File:         tstamp.h
+ * Authors:      Marcin ********
+ * Date:         19.10.2026
+ * Description:  Software kernel timestamps of UDP datagrams, shared by
+ *               the UDP client and server. The RX stamp is taken when
+ *               the packet enters the stack (netif_receive), the TX
+ *               stamp when it is handed to the device, so the interval
+ *               kernel RX -> app covers stack processing and the
+ *               socket queue together.
+ */
+
+#ifndef TSTAMP_H
+#define TSTAMP_H
+
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+
+/**
+ * Function enable software RX and TX kernel timestamps on the socket.
+ *
+ * @param fd is a socket descriptor
+ * @return 0 on success, -1 on error
+ */
+static inline int enable_timestamping(int fd) {
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+
+/**
+ * Function recive datagram together with its kernel RX timestamp.
+ *
+ * @param fd is a socket descriptor
+ * @param buf is a data buffer
+ * @param len is a size of the data buffer
+ * @param addr is a sender address structure
+ * @param addr_len is a size of the sender address structure
+ * @param rx_ts is a kernel RX timestamp (zeroed if not reported)
+ * @return number of bytes recived or -1 on error
+ */
+static inline ssize_t recv_timestamped(int fd, char *buf, size_t len,
+                                       struct sockaddr_in *addr, socklen_t *addr_len,
+                                       struct timespec *rx_ts) {
+
+  /* Buffer for control messages. */
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg = {
+    .msg_name = addr,
+    .msg_namelen = *addr_len,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+
+  ssize_t n = recvmsg(fd, &msg, 0);
+  if ( n < 0 ) {
+    return n;
+  }
+  *addr_len = msg.msg_namelen;
+
+  /* Software timestamp is the first one in scm_timestamping. */
+  memset(rx_ts, 0, sizeof(*rx_ts));
+  for ( struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+    if ( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING ) {
+      struct scm_timestamping *tss = (struct scm_timestamping *) CMSG_DATA(cm);
+      *rx_ts = tss->ts[0];
+    }
+  }
+
+  return n;
+}
+
+
+/**
+ * Function read kernel TX timestamp of the last sent datagram
+ * from the socket error queue.
+ *
+ * @param fd is a socket descriptor
+ * @param tx_ts is a kernel TX timestamp
+ * @return 0 on success, -1 if no timestamp was reported
+ */
+static inline int recv_tx_timestamp(int fd, struct timespec *tx_ts) {
+
+  /* Buffer for control messages (timestamp and extended error). */
+  char control[512];
+
+  struct msghdr msg = {
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+
+  /* Wait until timestamp appears in the error queue. */
+  struct pollfd pfd = { .fd = fd, .events = 0 };
+  if ( poll(&pfd, 1, 100) <= 0 || !(pfd.revents & POLLERR) ) {
+    return -1;
+  }
+
+  if ( recvmsg(fd, &msg, MSG_ERRQUEUE) < 0 ) {
+    return -1;
+  }
+
+  for ( struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+    if ( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING ) {
+      struct scm_timestamping *tss = (struct scm_timestamping *) CMSG_DATA(cm);
+      *tx_ts = tss->ts[0];
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+
+/**
+ * Function return difference (a - b) in microseconds.
+ */
+static inline double ts_diff_us(const struct timespec *a, const struct timespec *b) {
+  return (a->tv_sec - b->tv_sec) * 1e6 + (a->tv_nsec - b->tv_nsec) / 1e3;
+}
+
+#endif /* TSTAMP_H */
@@ -14,10 +14,19 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/time.h>
+
+#include "tstamp.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define REPLY_TIMEOUT_MS 100
 
 
 /**************************** FUNCTIONS *******************************/
@@ -27,6 +36,39 @@
  */
 void print_info();
 
+
+/**
+ * Function send count requests to the server and print statistics.
+ * In ping-pong mode every request waits for its reply (or timeout) and
+ * latency percentiles are printed. In flood mode requests are sent
+ * back to back and only replies are counted.
+ * 
+ * @param fd is a socket descriptor
+ * @param addr is a server address structure
+ * @param count is a number of requests
+ * @param flood is a flood mode flag
+ */
+void bench_func(int fd, const struct sockaddr_in *addr, long count, bool flood);
+
+
+/**
+ * Function replace the benchmark socket with a new one (new source
+ * port) connected to the server. Replies carry no request number, so
+ * a late reply of a timed out request is told from the next one only
+ * by going to the closed port.
+ * 
+ * @param fd is a socket descriptor, kept by dup2()
+ * @param addr is a server address structure
+ * @return 0 on success, -1 on error
+ */
+int bench_renew_socket(int fd, const struct sockaddr_in *addr);
+
+
+/**
+ * Function compare two latencies for qsort().
+ */
+int cmp_u64(const void *a, const void *b);
+
 /**********************************************************************/
 
 
@@ -37,11 +79,18 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Kernel timestamping is disabled by default. */
+  bool timestamping = false;
+
+  /* Benchmark mode is disabled by default. */
+  long bench_count = 0;
+  bool flood = false;
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:tn:fh")) != -1 ) {
 	/* Case for "client -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -58,6 +107,15 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 't':
+		timestamping = true;
+		break;
+	  case 'n':
+		bench_count = atol(optarg);
+		break;
+	  case 'f':
+		flood = true;
+		break;
 	  case ':':
 		printf("Option needs a value\n");
 		exit(1);
@@ -86,6 +144,19 @@ int main(int argc, char **argv) {
     exit(2);
   }
 
+  /* Ask kernel for software RX/TX timestamps. */
+  if ( timestamping && enable_timestamping(serv_socket) < 0 ) {
+    fprintf(stderr, "ERROR setsockopt(SO_TIMESTAMPING): %s\n", strerror(errno));
+    exit(3);
+  }
+
+  /* Benchmark mode. */
+  if ( bench_count > 0 ) {
+    bench_func(serv_socket, &serv_addr, bench_count, flood);
+    close(serv_socket);
+    return 0;
+  }
+
   /* Data buffer. */
   char buffer[MAX_MSG_LEN];
 
@@ -101,6 +172,10 @@ int main(int argc, char **argv) {
   /* Copy message to send to the buffer. */
   strcpy(buffer, "Hello world!!!");
   
+  /* Kernel and application timestamps. */
+  struct timespec app_tx_ts = {}, tx_ts = {}, rx_ts = {}, app_rx_ts = {};
+  clock_gettime(CLOCK_REALTIME, & app_tx_ts);
+  
   /* Send data. */
   if ( sendto(serv_socket, (const char *)buffer, strlen(buffer), MSG_CONFIRM, (const struct sockaddr *) & serv_addr, lens) <= 0 ) {
     fprintf(stderr, "ERROR send(): %s\n", strerror(errno));
@@ -108,19 +183,61 @@ int main(int argc, char **argv) {
   }
   printf("Message sent.\n");
   
+  /* Get TX timestamp before the reply arrives. */
+  if ( timestamping && recv_tx_timestamp(serv_socket, & tx_ts) < 0 ) {
+    fprintf(stderr, "Kernel TX timestamp not reported.\n");
+    timestamping = false;
+  }
+  
   /* Clear buffer. */
   bzero(buffer, MAX_MSG_LEN);
   
   /* Recive data. */
-  if ( (n = recvfrom(serv_socket, buffer, MAX_MSG_LEN-1, MSG_WAITALL, (struct sockaddr*) & serv_addr, & lens)) <= 0 ) {
+  if ( timestamping ) {
+    n = recv_timestamped(serv_socket, buffer, MAX_MSG_LEN-1, & serv_addr, & lens, & rx_ts);
+  } else {
+    n = recvfrom(serv_socket, buffer, MAX_MSG_LEN-1, MSG_WAITALL, (struct sockaddr*) & serv_addr, & lens);
+  }
+  if ( n <= 0 ) {
 	fprintf(stderr, "ERROR recvfrom(): %s\n", strerror(errno));
     exit(4);    
   }
+  clock_gettime(CLOCK_REALTIME, & app_rx_ts);
   buffer[n] = '\0';
   
   /* Print recived data. */
   printf("Recived:\n%s\n\n", buffer);
   
+  /* Print latency breakdown. */
+  if ( timestamping && rx_ts.tv_sec != 0 ) {
+    printf("Latency breakdown [us]:\n");
+    printf("  kernel stack (app TX -> kernel TX):   %10.3f\n", ts_diff_us(& tx_ts, & app_tx_ts));
+    printf("  network + server (kernel TX -> RX):   %10.3f\n", ts_diff_us(& rx_ts, & tx_ts));
+    printf("  kernel RX -> app (stack + queue):     %10.3f\n", ts_diff_us(& app_rx_ts, & rx_ts));
+    printf("  round trip (app TX -> app RX):        %10.3f\n", ts_diff_us(& app_rx_ts, & app_tx_ts));
+    
+    /* Server appends its kernel RX and application TX timestamps after
+     * the message. One-way delays are valid only with synchronized clocks
+     * (the same host or PTP). */
+    size_t msg_len = strlen(buffer) + 1;
+    if ( (size_t) n >= msg_len + 2 * sizeof(uint64_t) ) {
+      uint64_t stamps[2];
+      memcpy(stamps, buffer + msg_len, sizeof(stamps));
+      struct timespec srv_rx_ts = {
+        .tv_sec = be64toh(stamps[0]) / 1000000000ULL,
+        .tv_nsec = be64toh(stamps[0]) % 1000000000ULL
+      };
+      struct timespec srv_tx_ts = {
+        .tv_sec = be64toh(stamps[1]) / 1000000000ULL,
+        .tv_nsec = be64toh(stamps[1]) % 1000000000ULL
+      };
+      printf("  one-way request (kernel TX -> server):%10.3f\n", ts_diff_us(& srv_rx_ts, & tx_ts));
+      printf("  server residence:                     %10.3f\n", ts_diff_us(& srv_tx_ts, & srv_rx_ts));
+      printf("  one-way reply (server -> kernel RX):  %10.3f\n", ts_diff_us(& rx_ts, & srv_tx_ts));
+    }
+    printf("\n");
+  }
+  
   /* Close server socket. */
   close(serv_socket);
   
@@ -139,6 +256,109 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port (default port is \"8888\")\n");
+	printf("       -t            enable kernel timestamps and print latency breakdown\n");
+	printf("       -n [count]    benchmark: send count requests and print statistics\n");
+	printf("       -f            benchmark without waiting for replies (flood)\n");
 	printf("\n");
 	printf("\n");
 }
+
+void bench_func(int fd, const struct sockaddr_in *addr, long count, bool flood) {
+  const char msg[] = "Hello world!!!";
+  char buffer[MAX_MSG_LEN];
+  uint64_t *lat = malloc(count * sizeof(uint64_t));
+  long received = 0, sent = 0;
+
+  if ( lat == NULL ) {
+    fprintf(stderr, "ERROR malloc(): %s\n", strerror(errno));
+    exit(6);
+  }
+
+  /* Connected socket receives replies only from the server. */
+  if ( connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0 ) {
+    fprintf(stderr, "ERROR connect(): %s\n", strerror(errno));
+    exit(3);
+  }
+  struct timeval tv = { 0, REPLY_TIMEOUT_MS * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct timespec start, end, t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for ( long i = 0; i < count; i++ ) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ( send(fd, msg, sizeof(msg) - 1, 0) < 0 ) {
+      /* Refused by ICMP or out of buffer space, count as lost. */
+      continue;
+    }
+    sent++;
+    if ( flood ) {
+      /* Drain replies on the way, so they do not overflow our buffer. */
+      while ( recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0 ) {
+        received++;
+      }
+      continue;
+    }
+    if ( recv(fd, buffer, sizeof(buffer), 0) < 0 ) {
+      /* Timed out: its late reply must not answer the next request. */
+      if ( bench_renew_socket(fd, addr) < 0 ) {
+        fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+        exit(3);
+      }
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    lat[received++] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  /* Collect replies to the flood until the server stops answering. */
+  if ( flood ) {
+    while ( recv(fd, buffer, sizeof(buffer), 0) >= 0 ) {
+      received++;
+    }
+  }
+
+  double total = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Requests: %ld, sent: %ld, replies: %ld (%.2f%%), time: %.3f s, %.0f req/s\n",
+         count, sent, received, 100.0 * received / count, total, sent / total);
+
+  if ( !flood && received > 0 ) {
+    double sum = 0;
+    for ( long i = 0; i < received; i++ ) {
+      sum += lat[i];
+    }
+    qsort(lat, received, sizeof(uint64_t), cmp_u64);
+    printf("Latency [us]: min %.3f avg %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+           lat[0] / 1e3, sum / received / 1e3, lat[received / 2] / 1e3,
+           lat[received * 99 / 100] / 1e3, lat[received * 999 / 1000] / 1e3, lat[received - 1] / 1e3);
+  }
+  printf("\n");
+
+  free(lat);
+}
+
+
+int bench_renew_socket(int fd, const struct sockaddr_in *addr) {
+  struct timeval tv = { 0, REPLY_TIMEOUT_MS * 1000 };
+  int nfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if ( nfd < 0 ) {
+    return -1;
+  }
+  if ( setsockopt(nfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+       connect(nfd, (const struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+       dup2(nfd, fd) < 0 ) {
+    close(nfd);
+    return -1;
+  }
+  close(nfd);
+
+  return 0;
+}
+
+
+int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
@@ -5,6 +5,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +16,117 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <endian.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "tstamp.h"
+#include "ratelimit.h"
+#include "../TRACE/trace.h"
+#include "../RESTART/hot_restart.h"
+#include "../LOWLAT/lowlat.h"
+#include "../CORO/coro.h"
 
 #define MAX_MSG_LEN 4096
 #define SERV_PORT "8888"
 #define SERV_IP "127.0.0.1"
+#define MAX_STAGE_THREADS 64
+#define PIPE_POOL 4096         /* packet slots per receive thread */
+#define PIPE_RING 1024         /* entries of a worker ring, power of 2 */
+#define PIPE_BATCH 32          /* recvmmsg()/sendmmsg() batch */
+
+
+/* Preallocated packet slot, owned by one receive thread. */
+struct pkt {
+  struct sockaddr_in addr;
+  uint32_t len;
+  uint16_t owner;              /* receive thread to return the slot to */
+  char data[MAX_MSG_LEN];
+};
+
+/* Cell of the bounded lock-free ring. */
+struct ring_cell {
+  _Atomic uint64_t seq;
+  struct pkt *p;
+};
+
+/* Bounded multi-producer single-consumer ring of packet slots. */
+struct pkt_ring {
+  _Alignas(64) _Atomic uint64_t tail;    /* next cell of producers */
+  _Alignas(64) _Atomic uint64_t head;    /* next cell of the consumer */
+  _Atomic uint64_t high;                 /* occupancy high watermark */
+  uint64_t mask;
+  struct ring_cell *cells;
+};
+
+/* Receive thread: fills its slots and publishes them to workers. */
+struct pipe_receiver {
+  int fd;
+  int efd;                               /* eventfd, slots returned */
+  pthread_t thread;
+  struct pkt_ring free;                  /* slots returned by workers */
+  struct pkt *pool;
+  _Atomic int sleeping;
+  _Atomic uint64_t received;
+  _Atomic uint64_t kernel_drops;         /* SO_RXQ_OVFL of the socket */
+  _Atomic uint64_t no_slot_waits;        /* pool empty, workers behind */
+  _Atomic uint64_t ring_drops;           /* worker ring full */
+  _Atomic int stopped;                   /* left the loop on restart */
+};
+
+/* Processing worker: answers packets of its ring in batches. */
+struct pipe_worker {
+  int fd;                                /* socket for replies */
+  int efd;                               /* eventfd for wake up */
+  pthread_t thread;
+  struct pkt_ring in;
+  _Atomic int sleeping;
+  struct rate_limit rl;                  /* own table, no sharing */
+  _Atomic uint64_t processed;
+  _Atomic uint64_t batches;
+};
+
+/* Socket as a stackless coroutine (-e mode). */
+struct udp_coro {
+  struct coro co;
+  struct sockaddr_in addr;               /* source of the datagram */
+  socklen_t len;
+  struct rate_limit *rl;
+};
+
+/* Stages of the pipeline mode, set once in pipe_serve(). */
+static struct pipe_receiver *receivers;
+static int n_receivers;
+static struct pipe_worker *workers;
+static int n_workers;
+
+/* Set by SIGUSR1, counters are printed by the main loop. */
+static volatile sig_atomic_t stats_requested;
+
+/* Set by SIGHUP, main loop hands sockets over to a new instance. */
+static volatile sig_atomic_t restart_requested;
+
+/* Set by SIGUSR1 and SIGHUP, returns from the event engine. */
+static volatile sig_atomic_t coro_interrupt;
+
+/* SIGUSR1 and SIGHUP are blocked and delivered only while the main
+ * thread waits with this mask, never between a flag check and a wait. */
+static sigset_t wait_mask;
+
+/* Receive threads stop taking datagrams, new instance serves them. */
+static _Atomic int pipe_stopping;
+
+/* Low latency configuration, set once in main(). */
+static int busy_poll_us;                 /* 0 = blocking mode */
 
 
 /**************************** FUNCTIONS *******************************/
@@ -27,6 +136,134 @@
  */
 void print_info();
 
+
+/**
+ * SIGUSR1 handler, requests counters.
+ */
+void stats_handler(int sig);
+
+
+/**
+ * SIGHUP handler, requests hot restart.
+ */
+void restart_handler(int sig);
+
+
+/**
+ * Function start new instance and pass it the bound sockets.
+ * 
+ * @param fds is an array of bound sockets
+ * @param n is a number of sockets
+ * @param argv is an argument vector of main()
+ * @return 0 if new instance serves the sockets, -1 on error
+ */
+int hot_restart(const int *fds, int n, char **argv);
+
+
+/**
+ * Function allocate the ring.
+ * 
+ * @param r is a ring
+ * @param size is a number of cells, power of 2
+ * @return 0 on success, -1 on error
+ */
+int ring_init(struct pkt_ring *r, size_t size);
+
+
+/**
+ * Function publish the slot in the ring, safe for many producers.
+ * 
+ * @return true on success, false if the ring is full
+ */
+bool ring_push(struct pkt_ring *r, struct pkt *p);
+
+
+/**
+ * Function take the oldest slot from the ring (single consumer).
+ * 
+ * @return slot or NULL if the ring is empty
+ */
+struct pkt *ring_pop(struct pkt_ring *r);
+
+
+/**
+ * Function start staged pipeline: receive threads read datagrams with
+ * recvmmsg() into preallocated slots and pass them through lock-free
+ * rings to workers, which reply with sendmmsg(). Source address selects
+ * the worker, so the rate limiter of a source lives in one worker.
+ * Returns when all stages run.
+ * 
+ * @param fds is an array of bound sockets (with SO_REUSEPORT), receivers
+ *        without a socket bind their own
+ * @param nfds is a number of sockets
+ * @param addr is a server address structure
+ * @param nrecv is a number of receive threads
+ * @param nwork is a number of workers
+ * @param rl is a rate limiter configuration
+ */
+void pipe_serve(const int *fds, int nfds, struct sockaddr_in *addr, int nrecv, int nwork,
+                const struct rate_limit *rl);
+
+
+/**
+ * Function stop receive threads and wait until workers answered all
+ * datagrams already taken from the sockets.
+ */
+void pipe_drain(void);
+
+
+/**
+ * Receive thread. With no free slot it waits for workers to return
+ * some and leaves datagrams queued in the socket, so only the kernel
+ * drops (when the socket buffer overflows).
+ * 
+ * @param arg is a struct pipe_receiver
+ */
+void *pipe_receiver_func(void *arg);
+
+
+/**
+ * Worker thread.
+ * 
+ * @param arg is a struct pipe_worker
+ */
+void *pipe_worker_func(void *arg);
+
+
+/**
+ * Function print counters of all pipeline stages.
+ */
+void pipe_print_stats(void);
+
+
+/**
+ * SIGUSR2 handler, only interrupts blocking receive of a stopping
+ * receive thread.
+ */
+void wake_handler(int sig);
+
+
+/**
+ * Function serve the socket with a coroutine on the event engine.
+ * Never returns.
+ * 
+ * @param fd is a bound socket
+ * @param kind is CORO_POLL or CORO_EPOLL
+ * @param rl is a rate limiter
+ * @param argv is an argument vector of main()
+ */
+void coro_serve(int fd, enum coro_engine_kind kind, struct rate_limit *rl, char **argv);
+
+
+/**
+ * Datagram handler of the coroutine mode.
+ * 
+ * @param c is a struct udp_coro
+ * @return what the coroutine waits for
+ */
+int udp_coro_fn(struct coro *c);
+
+
 /**********************************************************************/
 
 
@@ -37,11 +274,26 @@ int main(int argc, char **argv) {
   
   /* Set default IP address of the server. */
   char serv_ip[] = SERV_IP;
+
+  /* Kernel timestamping is disabled by default. */
+  bool timestamping = false;
+
+  /* Rate limiting is disabled by default. */
+  struct rate_limit rl = {};
+
+  /* Memory locking is disabled by default. */
+  bool lock = false;
+
+  /* Staged pipeline is disabled by default. */
+  int nrecv = 0, nwork = 1;
+
+  /* Event engine of the coroutine mode, -1 = blocking loop. */
+  int engine = -1;
 	
   /* Parsing user arguments. */
   int c, prev_ind;
 
-  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:h")) != -1 ) {
+  while ( prev_ind = optind, (c = getopt(argc, argv, ":p:i:tr:B:g:P:C:LR:w:e:h")) != -1 ) {
 	/* Case for "server -i -p". */
 	if ( optind == prev_ind + 2 && *optarg == '-' ) {
 	  c = ':';
@@ -58,6 +310,46 @@ int main(int argc, char **argv) {
 	  case 'i':
 		strcpy(serv_ip, optarg);
 		break;
+	  case 't':
+		timestamping = true;
+		break;
+	  case 'r':
+		rl.rate = atol(optarg);
+		break;
+	  case 'B':
+		rl.burst = atol(optarg);
+		break;
+	  case 'g':
+		rl.global_rate = atol(optarg);
+		break;
+	  case 'P':
+		busy_poll_us = atoi(optarg);
+		break;
+	  case 'C':
+		if ( parse_cpus(optarg) < 0 ) {
+		  fprintf(stderr, "Wrong CPU list: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
+	  case 'L':
+		lock = true;
+		break;
+	  case 'R':
+		nrecv = atoi(optarg);
+		break;
+	  case 'w':
+		nwork = atoi(optarg);
+		break;
+	  case 'e':
+		if ( strcmp(optarg, "poll") == 0 ) {
+		  engine = CORO_POLL;
+		} else if ( strcmp(optarg, "epoll") == 0 ) {
+		  engine = CORO_EPOLL;
+		} else {
+		  fprintf(stderr, "Unknown event engine: %s.\n", optarg);
+		  exit(1);
+		}
+		break;
 	  case ':':
 		printf("Option needs a value\n");
 		exit(1);
@@ -79,22 +371,98 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  /* Create server socket. */
-  const int serv_socket = socket(AF_INET, SOCK_DGRAM, 0);
-  if ( serv_socket < 0 ) {
-    fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
-    exit(2);
+  if ( nrecv > 0 && (timestamping || nrecv > MAX_STAGE_THREADS || nwork < 1 || nwork > MAX_STAGE_THREADS) ) {
+    fprintf(stderr, "Wrong pipeline parameters (no -t, at most %d threads).\n", MAX_STAGE_THREADS);
+    exit(1);
+  }
+
+  if ( engine >= 0 && (timestamping || nrecv > 0 || busy_poll_us) ) {
+    fprintf(stderr, "Event engine (-e) does not work with -t, -R and -P.\n");
+    exit(1);
   }
 
-  /* Calculate size of server address structure. */
-  socklen_t len = sizeof(serv_addr);
+  /* Sockets of the old instance after hot restart. */
+  int sock_fds[HOT_RESTART_MAX_FDS], conn_fds[HOT_RESTART_MAX_FDS];
+  int n_socks, n_conn;
+  const int restarted = hot_restart_recv(sock_fds, &n_socks, conn_fds, &n_conn, HOT_RESTART_MAX_FDS);
+  if ( restarted < 0 || (restarted && n_socks < 1) ) {
+    exit(5);
+  }
 
-  /* Assigns a local protocol address to a socket. */
-  if ( bind(serv_socket, (struct sockaddr*) &serv_addr, len) < 0 ) {
-    fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+  int serv_socket;
+
+  if ( restarted ) {
+    serv_socket = sock_fds[0];
+    printf("Took over %d socket(s).\n", n_socks);
+  } else {
+    /* Create server socket. */
+    serv_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ( serv_socket < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      exit(2);
+    }
+    sock_fds[0] = serv_socket;
+    n_socks = 1;
+
+    /* Calculate size of server address structure. */
+    socklen_t len = sizeof(serv_addr);
+
+    /* Every receive thread of the pipeline has its own socket. */
+    if ( nrecv > 0 ) {
+      int on = 1;
+      setsockopt(serv_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
+    /* Assigns a local protocol address to a socket. */
+    if ( bind(serv_socket, (struct sockaddr*) &serv_addr, len) < 0 ) {
+      fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+      exit(3);
+    }
+  }
+
+  /* Ask kernel for software RX/TX timestamps. */
+  if ( timestamping && enable_timestamping(serv_socket) < 0 ) {
+    fprintf(stderr, "ERROR setsockopt(SO_TIMESTAMPING): %s\n", strerror(errno));
     exit(3);
   }
 
+  /* Prepare rate limiter, bursts default to one second of traffic. */
+  rl.global_burst = rl.global_rate < RL_MAX_BURST ? rl.global_rate : RL_MAX_BURST;
+  if ( rl.rate > 0 ) {
+    if ( rl.burst == 0 || rl.burst > RL_MAX_BURST ) {
+      rl.burst = rl.rate < RL_MAX_BURST ? rl.rate : RL_MAX_BURST;
+    }
+    rl.table = aligned_alloc(64, RL_BUCKETS * sizeof(struct rl_bucket));
+    if ( rl.table == NULL ) {
+      fprintf(stderr, "ERROR aligned_alloc(): %s\n", strerror(errno));
+      exit(2);
+    }
+    memset(rl.table, 0, RL_BUCKETS * sizeof(struct rl_bucket));
+  }
+
+  /* Low latency mode: spin on a non-blocking socket on a pinned CPU. */
+  if ( busy_poll_us ) {
+    busy_poll_setup(serv_socket, busy_poll_us);
+  }
+  pin_thread();
+  if ( lock ) {
+    lock_memory();
+  }
+
+  /* Counters are printed on SIGUSR1, hot restart on SIGHUP. Both
+   * interrupt only the waits with wait_mask. */
+  struct sigaction sa = { .sa_handler = stats_handler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = restart_handler;
+  sigaction(SIGHUP, &sa, NULL);
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sigs, &wait_mask);
+  sigdelset(&wait_mask, SIGUSR1);
+  sigdelset(&wait_mask, SIGHUP);
 
   /* Data buffer. */
   char buffer[MAX_MSG_LEN];
@@ -102,34 +470,142 @@ int main(int argc, char **argv) {
   /* Number of characters recived. */
   int n;
   
-  /* Address structure for the client socket. */
-  struct sockaddr_in cli_addr = {};
-  
-  /* Variable with size of client address structure. */
-  socklen_t lenc = sizeof(cli_addr);
-  
   printf("Waiting for connection...\n");
-  
-  /* Recive data. */
-  if ( (n = recvfrom(serv_socket, buffer, MAX_MSG_LEN-1, MSG_WAITALL, (struct sockaddr*) & cli_addr, & lenc)) <= 0 ) {
-	fprintf(stderr, "ERROR recvfrom(): %s\n", strerror(errno));
-    exit(4);    
+
+  if ( nrecv > 0 ) {
+    /* Sockets of receivers the new configuration does not have. */
+    for ( int i = nrecv; i < n_socks; i++ ) {
+      close(sock_fds[i]);
+    }
+    pipe_serve(sock_fds, n_socks < nrecv ? n_socks : nrecv, &serv_addr, nrecv, nwork, &rl);
+    hot_restart_ready();
+
+    while ( 1 ) {
+      sigsuspend(&wait_mask);
+      if ( stats_requested ) {
+        stats_requested = 0;
+        pipe_print_stats();
+      }
+      if ( restart_requested ) {
+        restart_requested = 0;
+        for ( int i = 0; i < n_receivers; i++ ) {
+          sock_fds[i] = receivers[i].fd;
+        }
+        if ( hot_restart(sock_fds, n_receivers, argv) == 0 ) {
+          pipe_drain();
+          printf("Old instance drained, exiting.\n");
+          exit(0);
+        }
+      }
+    }
+  }
+
+  /* Old instance exits from now on. */
+  hot_restart_ready();
+  if ( engine >= 0 ) {
+    coro_serve(serv_socket, engine, &rl, argv);
+  }
+
+  /* Busy polling never blocks, it takes the signals at any time. */
+  if ( busy_poll_us ) {
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
   }
-  buffer[n] = '\0';
-  
-  /* Print recived data. */
-  printf("Recived:\n%s\n\n", buffer);
-  
-  /* Clear buffer. */
-  bzero(buffer, MAX_MSG_LEN);
-  
-  /* Copy message to send to the buffer. */
-  strcpy(buffer, "Hello client!");
   
-  /* Send data. */
-  if ( sendto(serv_socket, (const char *)buffer, strlen(buffer), MSG_CONFIRM, (const struct sockaddr *) & cli_addr, lenc) <= 0 ) {
-    fprintf(stderr, "ERROR send(): %s\n", strerror(errno));
-    exit(5);
+  while ( 1 ) {
+
+    /* Queued datagrams stay in the socket for the new instance. */
+    if ( restart_requested ) {
+      restart_requested = 0;
+      if ( hot_restart(&serv_socket, 1, argv) == 0 ) {
+        printf("Old instance drained, exiting.\n");
+        exit(0);
+      }
+    }
+
+    /* Address structure for the client socket. */
+    struct sockaddr_in cli_addr = {};
+    
+    /* Variable with size of client address structure. */
+    socklen_t lenc = sizeof(cli_addr);
+    
+    /* Kernel and application timestamps. */
+    struct timespec rx_ts = {}, app_rx_ts = {}, app_tx_ts = {}, tx_ts = {};
+    
+    /* Recive data. */
+    TRACE_POINT(TRACE_READ_BEGIN, serv_socket);
+    if ( !busy_poll_us && hot_restart_wait_fd(serv_socket, POLLIN, &wait_mask) < 0 ) {
+      n = -1;
+    } else {
+      do {
+        if ( timestamping ) {
+          n = recv_timestamped(serv_socket, buffer, MAX_MSG_LEN-1, & cli_addr, & lenc, & rx_ts);
+        } else {
+          n = recvfrom(serv_socket, buffer, MAX_MSG_LEN-1, MSG_WAITALL, (struct sockaddr*) & cli_addr, & lenc);
+        }
+      } while ( busy_poll_us && n < 0 && errno == EAGAIN && !stats_requested && !restart_requested );
+    }
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( stats_requested ) {
+      stats_requested = 0;
+      rl_print_stats(&rl);
+    }
+    if ( n < 0 && (errno == EINTR || errno == EAGAIN) ) {
+      continue;
+    }
+    if ( n < 0 ) {
+      fprintf(stderr, "ERROR recvfrom(): %s\n", strerror(errno));
+      exit(4);
+    }
+    clock_gettime(CLOCK_REALTIME, & app_rx_ts);
+    
+    /* Drop excess traffic before any reply work. */
+    rl.received++;
+    if ( (rl.rate || rl.global_rate) && !rl_allow(&rl, cli_addr.sin_addr.s_addr) ) {
+      continue;
+    }
+    buffer[n] = '\0';
+    
+    /* Clear buffer. */
+    bzero(buffer, MAX_MSG_LEN);
+    
+    /* Copy message to send to the buffer. */
+    strcpy(buffer, "Hello client!");
+    size_t msg_len = strlen(buffer);
+    
+    /* Append kernel RX and application TX timestamps after the message,
+     * so the client can split round trip into one-way delays. */
+    if ( timestamping ) {
+      clock_gettime(CLOCK_REALTIME, & app_tx_ts);
+      uint64_t stamps[2] = {
+        htobe64(rx_ts.tv_sec * 1000000000ULL + rx_ts.tv_nsec),
+        htobe64(app_tx_ts.tv_sec * 1000000000ULL + app_tx_ts.tv_nsec)
+      };
+      memcpy(buffer + msg_len + 1, stamps, sizeof(stamps));
+      msg_len += 1 + sizeof(stamps);
+    }
+    
+    /* Send data. */
+    TRACE_POINT(TRACE_WRITE_BEGIN, serv_socket);
+    n = sendto(serv_socket, (const char *)buffer, msg_len, MSG_CONFIRM, (const struct sockaddr *) & cli_addr, lenc);
+    TRACE_POINT(TRACE_WRITE_END, n);
+    if ( n <= 0 ) {
+      fprintf(stderr, "ERROR send(): %s\n", strerror(errno));
+      continue;
+    }
+    
+    /* Print latency breakdown. */
+    if ( timestamping ) {
+      if ( rx_ts.tv_sec == 0 || recv_tx_timestamp(serv_socket, & tx_ts) < 0 ) {
+        fprintf(stderr, "Kernel timestamps not reported.\n");
+      } else {
+        printf("Latency breakdown [us]:\n");
+        printf("  kernel RX -> app (stack + queue):  %10.3f\n", ts_diff_us(& app_rx_ts, & rx_ts));
+        printf("  application (app RX -> app TX):    %10.3f\n", ts_diff_us(& app_tx_ts, & app_rx_ts));
+        printf("  kernel stack (app TX -> kernel TX):%10.3f\n", ts_diff_us(& tx_ts, & app_tx_ts));
+        printf("\n");
+      }
+    }
+    
   }
   
   /* Close server socket. */
@@ -150,6 +626,549 @@ void print_info() {
 	printf("       -h            show this help\n");
 	printf("       -i [ip]       set ip address (default ip is \"127.0.0.1\")\n");
 	printf("       -p [socket]   set port (default port is \"8888\")\n");
+	printf("       -t            enable kernel timestamps and print latency breakdown\n");
+	printf("       -r [pps]      limit packets per second of every source address\n");
+	printf("       -B [packets]  burst of the source limit (default is one second)\n");
+	printf("       -g [pps]      limit packets per second of all sources together\n");
+	printf("       -P [usec]     busy poll socket instead of blocking (SO_BUSY_POLL)\n");
+	printf("       -C [cpu,...]  pin server to the CPU\n");
+	printf("       -L            lock memory (mlockall) and prefault buffers\n");
+	printf("       -R [count]    staged pipeline with count receive threads\n");
+	printf("       -w [count]    pipeline workers (default 1), -g is split between them\n");
+	printf("       -e [engine]   serve socket with a coroutine on event engine:\n");
+	printf("                     poll or epoll\n");
+	printf("\n");
+	printf("Drop counters are printed on SIGUSR1.\n");
+	printf("SIGHUP starts new instance of the binary, passes it the sockets\n");
+	printf("and exits once the datagrams already received are answered.\n");
 	printf("\n");
 	printf("\n");
 }
+
+
+void restart_handler(int sig) {
+  (void) sig;
+  restart_requested = 1;
+  coro_interrupt = 1;
+}
+
+
+int hot_restart(const int *fds, int n, char **argv) {
+  printf("Hot restart...\n");
+
+  if ( hot_restart_spawn(argv) < 0 ) {
+    return -1;
+  }
+  if ( hot_restart_send(fds, n, NULL, 0) < 0 || hot_restart_wait_ready() < 0 ) {
+    fprintf(stderr, "ERROR: new instance failed, still serving.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void stats_handler(int sig) {
+  (void) sig;
+  stats_requested = 1;
+  coro_interrupt = 1;
+}
+
+int ring_init(struct pkt_ring *r, size_t size) {
+  r->cells = aligned_alloc(64, size * sizeof(struct ring_cell));
+  if ( r->cells == NULL ) {
+    return -1;
+  }
+  for ( size_t i = 0; i < size; i++ ) {
+    atomic_init(&r->cells[i].seq, i);
+  }
+  r->mask = size - 1;
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->head, 0);
+  atomic_init(&r->high, 0);
+
+  return 0;
+}
+
+
+bool ring_push(struct pkt_ring *r, struct pkt *p) {
+  uint64_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  /* Cell is free for position pos when its sequence equals pos. */
+  while ( 1 ) {
+    struct ring_cell *cell = &r->cells[pos & r->mask];
+    uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int64_t dif = (int64_t) (seq - pos);
+
+    if ( dif == 0 ) {
+      if ( atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed) ) {
+        cell->p = p;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if ( dif < 0 ) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+  }
+}
+
+
+struct pkt *ring_pop(struct pkt_ring *r) {
+  uint64_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  struct ring_cell *cell = &r->cells[pos & r->mask];
+
+  if ( atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1 ) {
+    return NULL;
+  }
+  struct pkt *p = cell->p;
+  atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+  atomic_store_explicit(&r->head, pos + 1, memory_order_relaxed);
+
+  return p;
+}
+
+
+void pipe_serve(const int *fds, int nfds, struct sockaddr_in *addr, int nrecv, int nwork,
+                const struct rate_limit *rl) {
+  n_receivers = nrecv;
+  n_workers = nwork;
+  receivers = calloc(nrecv, sizeof(struct pipe_receiver));
+  workers = calloc(nwork, sizeof(struct pipe_worker));
+  if ( receivers == NULL || workers == NULL ) {
+    fprintf(stderr, "ERROR calloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  for ( int i = 0; i < nrecv; i++ ) {
+    struct pipe_receiver *r = &receivers[i];
+    int on = 1;
+
+    /* Receivers use given sockets first, others bind their own. */
+    r->fd = i < nfds ? fds[i] : socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ( r->fd < 0 ) {
+      fprintf(stderr, "ERROR socket(): %s\n", strerror(errno));
+      exit(2);
+    }
+    if ( i >= nfds ) {
+      setsockopt(r->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+      if ( bind(r->fd, (struct sockaddr*) addr, sizeof(*addr)) < 0 ) {
+        fprintf(stderr, "ERROR bind(): %s\n", strerror(errno));
+        exit(3);
+      }
+    }
+    if ( busy_poll_us ) {
+      busy_poll_setup(r->fd, busy_poll_us);
+    }
+
+    /* Kernel reports its drop counter with every datagram. */
+    setsockopt(r->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+
+    r->efd = eventfd(0, 0);
+    if ( r->efd < 0 ) {
+      fprintf(stderr, "ERROR eventfd(): %s\n", strerror(errno));
+      exit(2);
+    }
+    r->pool = calloc(PIPE_POOL, sizeof(struct pkt));
+    if ( r->pool == NULL || ring_init(&r->free, PIPE_POOL) < 0 ) {
+      fprintf(stderr, "ERROR calloc(): %s\n", strerror(errno));
+      exit(2);
+    }
+    for ( int j = 0; j < PIPE_POOL; j++ ) {
+      r->pool[j].owner = i;
+      ring_push(&r->free, &r->pool[j]);
+    }
+  }
+
+  for ( int i = 0; i < nwork; i++ ) {
+    struct pipe_worker *w = &workers[i];
+
+    w->fd = receivers[i % nrecv].fd;
+    w->efd = eventfd(0, 0);
+    if ( w->efd < 0 || ring_init(&w->in, PIPE_RING) < 0 ) {
+      fprintf(stderr, "ERROR eventfd(): %s\n", strerror(errno));
+      exit(2);
+    }
+
+    /* Own copy of the rate limiter, global ceiling is split. */
+    w->rl = *rl;
+    w->rl.global_rate = rl->global_rate / nwork;
+    w->rl.global_burst = rl->global_burst / nwork;
+    if ( rl->global_rate && w->rl.global_rate == 0 ) {
+      w->rl.global_rate = w->rl.global_burst = 1;
+    }
+    if ( rl->rate ) {
+      w->rl.table = aligned_alloc(64, RL_BUCKETS * sizeof(struct rl_bucket));
+      if ( w->rl.table == NULL ) {
+        fprintf(stderr, "ERROR aligned_alloc(): %s\n", strerror(errno));
+        exit(2);
+      }
+      memset(w->rl.table, 0, RL_BUCKETS * sizeof(struct rl_bucket));
+    }
+  }
+
+  /* Threads inherit SIGUSR1 and SIGHUP blocked, only the main thread
+   * takes them in sigsuspend(). */
+  for ( int i = 0; i < nwork; i++ ) {
+    if ( pthread_create(&workers[i].thread, NULL, pipe_worker_func, &workers[i]) != 0 ) {
+      fprintf(stderr, "ERROR pthread_create()\n");
+      exit(2);
+    }
+  }
+  for ( int i = 0; i < nrecv; i++ ) {
+    if ( pthread_create(&receivers[i].thread, NULL, pipe_receiver_func, &receivers[i]) != 0 ) {
+      fprintf(stderr, "ERROR pthread_create()\n");
+      exit(2);
+    }
+  }
+}
+
+
+void pipe_drain(void) {
+  const struct timespec tick = { 0, 1000000 };
+
+  /* Signal breaks blocking recvmmsg(), repeat until the flag is seen. */
+  struct sigaction sa = { .sa_handler = wake_handler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+  atomic_store(&pipe_stopping, 1);
+
+  for ( int i = 0; i < n_receivers; i++ ) {
+    while ( !atomic_load(&receivers[i].stopped) ) {
+      pthread_kill(receivers[i].thread, SIGUSR2);
+      nanosleep(&tick, NULL);
+    }
+  }
+
+  /* Every published packet is answered (or dropped by rate limit). */
+  uint64_t published = 0, processed;
+  for ( int i = 0; i < n_receivers; i++ ) {
+    published += atomic_load(&receivers[i].received) - atomic_load(&receivers[i].ring_drops);
+  }
+  do {
+    nanosleep(&tick, NULL);
+    processed = 0;
+    for ( int i = 0; i < n_workers; i++ ) {
+      processed += atomic_load(&workers[i].processed);
+    }
+  } while ( processed < published );
+}
+
+
+void *pipe_receiver_func(void *arg) {
+  struct pipe_receiver *r = arg;
+  struct pkt *slots[PIPE_BATCH];
+  struct mmsghdr msgs[PIPE_BATCH];
+  struct iovec iov[PIPE_BATCH];
+  char control[PIPE_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+  bool wake[MAX_STAGE_THREADS];
+  bool starved = false;                  /* counted in no_slot_waits */
+  int have = 0;
+
+  pin_thread();
+
+  while ( !atomic_load_explicit(&pipe_stopping, memory_order_relaxed) ) {
+
+    /* Take free slots returned by workers. */
+    while ( have < PIPE_BATCH && (slots[have] = ring_pop(&r->free)) != NULL ) {
+      have++;
+    }
+
+    /* No slot: workers are behind, datagrams wait in the socket buffer.
+     * Announce sleep, check again, then wait for a returned slot. */
+    if ( have == 0 ) {
+      if ( !starved ) {
+        atomic_fetch_add_explicit(&r->no_slot_waits, 1, memory_order_relaxed);
+        starved = true;
+      }
+      if ( busy_poll_us ) {
+        continue;
+      }
+      atomic_store(&r->sleeping, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if ( (slots[0] = ring_pop(&r->free)) == NULL ) {
+        uint64_t v;
+        if ( read(r->efd, &v, sizeof(v)) < 0 && errno != EINTR ) {
+          fprintf(stderr, "ERROR read(eventfd): %s\n", strerror(errno));
+        }
+        continue;
+      }
+      atomic_store(&r->sleeping, 0);
+      have = 1;
+    }
+    starved = false;
+
+    for ( int i = 0; i < have; i++ ) {
+      iov[i] = (struct iovec) { .iov_base = slots[i]->data, .iov_len = MAX_MSG_LEN - 1 };
+      msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &slots[i]->addr,
+        .msg_namelen = sizeof(slots[i]->addr),
+        .msg_iov = &iov[i],
+        .msg_iovlen = 1,
+        .msg_control = control[i],
+        .msg_controllen = sizeof(control[i])
+      };
+    }
+
+    TRACE_POINT(TRACE_READ_BEGIN, r->fd);
+    int n = recvmmsg(r->fd, msgs, have, busy_poll_us ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+    TRACE_POINT(TRACE_READ_END, n);
+    if ( n < 0 ) {
+      if ( errno != EAGAIN && errno != EINTR ) {
+        fprintf(stderr, "ERROR recvmmsg(): %s\n", strerror(errno));
+      }
+      continue;
+    }
+    atomic_fetch_add_explicit(&r->received, n, memory_order_relaxed);
+    memset(wake, 0, sizeof(wake));
+
+    /* Publish packets, the worker is chosen by the source address. */
+    int kept = 0;
+    for ( int i = 0; i < n; i++ ) {
+      struct pkt *p = slots[i];
+      p->len = msgs[i].msg_len;
+
+      for ( struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm) ) {
+        if ( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL ) {
+          uint32_t ovfl;
+          memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+          atomic_store_explicit(&r->kernel_drops, ovfl, memory_order_relaxed);
+        }
+      }
+
+      /* High bits of the multiplicative hash: the low ones depend only
+       * on the first octet (network byte order), a /8 or /24 would
+       * land on one worker. */
+      uint32_t h = p->addr.sin_addr.s_addr * 2654435761u;
+      int w = ((uint64_t) h * n_workers) >> 32;
+      if ( ring_push(&workers[w].in, p) ) {
+        wake[w] = true;
+      } else {
+        atomic_fetch_add_explicit(&r->ring_drops, 1, memory_order_relaxed);
+        slots[kept++] = p;
+      }
+    }
+
+    /* Unused and dropped slots stay for the next batch. */
+    for ( int i = n; i < have; i++ ) {
+      slots[kept++] = slots[i];
+    }
+    have = kept;
+
+    /* Pairs with the fence of a worker going to sleep. */
+    atomic_thread_fence(memory_order_seq_cst);
+    for ( int w = 0; w < n_workers; w++ ) {
+      if ( wake[w] && atomic_exchange(&workers[w].sleeping, 0) ) {
+        uint64_t one = 1;
+        if ( write(workers[w].efd, &one, sizeof(one)) < 0 ) {
+          fprintf(stderr, "ERROR write(eventfd): %s\n", strerror(errno));
+        }
+      }
+    }
+  }
+  atomic_store(&r->stopped, 1);
+
+  return NULL;
+}
+
+
+void *pipe_worker_func(void *arg) {
+  struct pipe_worker *w = arg;
+  struct pkt *batch[PIPE_BATCH];
+  struct mmsghdr msgs[PIPE_BATCH];
+  bool wake[MAX_STAGE_THREADS];
+  char reply[] = "Hello client!";
+  struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) - 1 };
+
+  pin_thread();
+
+  while ( 1 ) {
+
+    /* Occupancy before draining shows how far the worker is behind. */
+    uint64_t occupancy = atomic_load_explicit(&w->in.tail, memory_order_relaxed) -
+                         atomic_load_explicit(&w->in.head, memory_order_relaxed);
+    if ( occupancy > atomic_load_explicit(&w->in.high, memory_order_relaxed) ) {
+      atomic_store_explicit(&w->in.high, occupancy, memory_order_relaxed);
+    }
+
+    int n = 0;
+    while ( n < PIPE_BATCH && (batch[n] = ring_pop(&w->in)) != NULL ) {
+      n++;
+    }
+
+    /* Empty ring: announce sleep, check again, then wait for a receiver. */
+    if ( n == 0 ) {
+      if ( busy_poll_us ) {
+        continue;
+      }
+      atomic_store(&w->sleeping, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if ( (batch[0] = ring_pop(&w->in)) == NULL ) {
+        uint64_t v;
+        if ( read(w->efd, &v, sizeof(v)) < 0 && errno != EINTR ) {
+          fprintf(stderr, "ERROR read(eventfd): %s\n", strerror(errno));
+        }
+        continue;
+      }
+      atomic_store(&w->sleeping, 0);
+      n = 1;
+    }
+
+    /* Drop excess traffic, reply to the rest with one sendmmsg(). One
+     * clock read serves the batch, it costs more than the lookup. */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    int out = 0;
+    for ( int i = 0; i < n; i++ ) {
+      struct pkt *p = batch[i];
+      w->rl.received++;
+      if ( (w->rl.rate || w->rl.global_rate) && !rl_allow_at(&w->rl, p->addr.sin_addr.s_addr, now_us) ) {
+        continue;
+      }
+      msgs[out++].msg_hdr = (struct msghdr) {
+        .msg_name = &p->addr,
+        .msg_namelen = sizeof(p->addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1
+      };
+    }
+
+    for ( int sent = 0; sent < out; ) {
+      TRACE_POINT(TRACE_WRITE_BEGIN, w->fd);
+      int k = sendmmsg(w->fd, msgs + sent, out - sent, 0);
+      TRACE_POINT(TRACE_WRITE_END, k);
+      if ( k <= 0 ) {
+        fprintf(stderr, "ERROR sendmmsg(): %s\n", strerror(errno));
+        break;
+      }
+      sent += k;
+    }
+
+    /* Return slots to their receive threads, wake those waiting. */
+    memset(wake, 0, sizeof(wake));
+    for ( int i = 0; i < n; i++ ) {
+      ring_push(&receivers[batch[i]->owner].free, batch[i]);
+      wake[batch[i]->owner] = true;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    for ( int r = 0; r < n_receivers; r++ ) {
+      if ( wake[r] && atomic_exchange(&receivers[r].sleeping, 0) ) {
+        uint64_t one = 1;
+        if ( write(receivers[r].efd, &one, sizeof(one)) < 0 ) {
+          fprintf(stderr, "ERROR write(eventfd): %s\n", strerror(errno));
+        }
+      }
+    }
+    atomic_fetch_add_explicit(&w->processed, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->batches, 1, memory_order_relaxed);
+  }
+
+  return NULL;
+}
+
+
+void pipe_print_stats(void) {
+  for ( int i = 0; i < n_receivers; i++ ) {
+    struct pipe_receiver *r = &receivers[i];
+    fprintf(stderr, "receiver %d: received %llu, kernel drops %llu, no slot waits %llu, ring full drops %llu\n",
+            i, (unsigned long long) atomic_load(&r->received),
+            (unsigned long long) atomic_load(&r->kernel_drops),
+            (unsigned long long) atomic_load(&r->no_slot_waits),
+            (unsigned long long) atomic_load(&r->ring_drops));
+  }
+  for ( int i = 0; i < n_workers; i++ ) {
+    struct pipe_worker *w = &workers[i];
+    uint64_t processed = atomic_load(&w->processed), batches = atomic_load(&w->batches);
+    fprintf(stderr, "worker %d: processed %llu, avg batch %.1f, ring occupancy %llu, high %llu of %d\n",
+            i, (unsigned long long) processed, batches ? (double) processed / batches : 0.0,
+            (unsigned long long) (atomic_load(&w->in.tail) - atomic_load(&w->in.head)),
+            (unsigned long long) atomic_load(&w->in.high), PIPE_RING);
+    if ( w->rl.rate || w->rl.global_rate ) {
+      fprintf(stderr, "worker %d: ", i);
+      rl_print_stats(&w->rl);
+    }
+  }
+}
+
+
+void wake_handler(int sig) {
+  (void) sig;
+}
+
+
+void coro_serve(int fd, enum coro_engine_kind kind, struct rate_limit *rl, char **argv) {
+  struct coro_engine e;
+
+  if ( coro_engine_init(&e, kind, fd + 1) < 0 ) {
+    fprintf(stderr, "ERROR coro_engine_init(): %s\n", strerror(errno));
+    exit(2);
+  }
+
+  struct udp_coro *u = calloc(1, sizeof(*u));
+  if ( u == NULL ) {
+    fprintf(stderr, "ERROR calloc(): %s\n", strerror(errno));
+    exit(2);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  u->co.fn = udp_coro_fn;
+  u->co.fd = fd;
+  u->rl = rl;
+  coro_spawn(&e, &u->co);
+  e.sigmask = &wait_mask;
+
+  while ( e.n > 0 ) {
+    coro_engine_run(&e, &coro_interrupt);
+    coro_interrupt = 0;
+    if ( stats_requested ) {
+      stats_requested = 0;
+      rl_print_stats(rl);
+    }
+    /* Queued datagrams stay in the socket for the new instance. */
+    if ( restart_requested ) {
+      restart_requested = 0;
+      if ( hot_restart(&fd, 1, argv) == 0 ) {
+        printf("Old instance drained, exiting.\n");
+        exit(0);
+      }
+    }
+  }
+  fprintf(stderr, "ERROR: socket handler failed.\n");
+  exit(4);
+}
+
+
+int udp_coro_fn(struct coro *c) {
+  struct udp_coro *u = (struct udp_coro *) c;
+  static char buffer[MAX_MSG_LEN];
+  static const char reply[] = "Hello client!";
+
+  CORO_BEGIN(c);
+  while ( 1 ) {
+    u->len = sizeof(u->addr);
+    TRACE_POINT(TRACE_READ_BEGIN, c->fd);
+    CORO_AWAIT(c, CORO_READ, recvfrom(c->fd, buffer, sizeof(buffer), 0, (struct sockaddr*) &u->addr, &u->len));
+    TRACE_POINT(TRACE_READ_END, c->ret);
+    if ( c->ret < 0 ) {
+      fprintf(stderr, "ERROR recvfrom(): %s\n", strerror(errno));
+      break;
+    }
+
+    /* Drop excess traffic before any reply work. */
+    u->rl->received++;
+    if ( (u->rl->rate || u->rl->global_rate) && !rl_allow(u->rl, u->addr.sin_addr.s_addr) ) {
+      continue;
+    }
+
+    /* Full socket buffer is the only reason to wait for a reply. */
+    TRACE_POINT(TRACE_WRITE_BEGIN, c->fd);
+    CORO_AWAIT(c, CORO_WRITE, sendto(c->fd, reply, sizeof(reply) - 1, 0, (struct sockaddr*) &u->addr, u->len));
+    TRACE_POINT(TRACE_WRITE_END, c->ret);
+    if ( c->ret < 0 ) {
+      fprintf(stderr, "ERROR send(): %s\n", strerror(errno));
+    }
+  }
+  CORO_END(c);
+}